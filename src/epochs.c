@@ -0,0 +1,271 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "cache/cache.h"
+
+#include "helpers.h"
+#include "epochs.h"
+
+/******************************************************************************
+ * READERS.
+ *****************************************************************************/
+
+static void
+free_reader(void *ptr)
+{
+    epoch_reader_t *reader;
+    CAST_OBJ_NOTNULL(reader, ptr, EPOCH_READER_MAGIC);
+    AZ(reader->depth);
+
+    AZ(pthread_mutex_lock(&vmod_state.epochs.mutex));
+    VTAILQ_REMOVE(&vmod_state.epochs.readers, reader, list);
+    AZ(pthread_mutex_unlock(&vmod_state.epochs.mutex));
+
+    free((void *) reader);
+}
+
+static epoch_reader_t *
+get_reader()
+{
+    epoch_reader_t *result = pthread_getspecific(vmod_state.epochs.key);
+    if (result == NULL) {
+        void *ptr;
+        AZ(posix_memalign(&ptr, EPOCH_CACHE_LINE, sizeof(epoch_reader_t)));
+        result = ptr;
+        INIT_OBJ(result, EPOCH_READER_MAGIC);
+        result->epoch = 0;
+        result->depth = 0;
+
+        AZ(pthread_mutex_lock(&vmod_state.epochs.mutex));
+        VTAILQ_INSERT_TAIL(&vmod_state.epochs.readers, result, list);
+        AZ(pthread_mutex_unlock(&vmod_state.epochs.mutex));
+
+        AZ(pthread_setspecific(vmod_state.epochs.key, result));
+    }
+    CHECK_OBJ_NOTNULL(result, EPOCH_READER_MAGIC);
+    return result;
+}
+
+// Pins the current epoch. Snapshots loaded using get_epoch_pointer() can be
+// used until leave_epoch() is called. Calls may be nested.
+epoch_reader_t *
+enter_epoch()
+{
+    epoch_reader_t *result = get_reader();
+    if (result->depth++ == 0) {
+        __atomic_store_n(
+            &result->epoch,
+            __atomic_load_n(&vmod_state.epochs.epoch, __ATOMIC_SEQ_CST),
+            __ATOMIC_SEQ_CST);
+    }
+    return result;
+}
+
+void
+leave_epoch(epoch_reader_t *reader)
+{
+    CHECK_OBJ_NOTNULL(reader, EPOCH_READER_MAGIC);
+    assert(reader->depth > 0);
+    if (--reader->depth == 0) {
+        __atomic_store_n(&reader->epoch, 0, __ATOMIC_SEQ_CST);
+        // The last reader of a retired snapshot may be this one, and no
+        // other snapshot may be published for a long time.
+        collect_epochs();
+    }
+}
+
+void *
+get_epoch_pointer(void **ptr)
+{
+    return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+}
+
+/******************************************************************************
+ * PINS.
+ *****************************************************************************/
+
+static void
+fini_epoch_pins(VRT_CTX, void *ptr)
+{
+    epoch_pin_t *pin, *previous;
+    CAST_OBJ_NOTNULL(pin, ptr, EPOCH_PIN_MAGIC);
+    while (pin != NULL) {
+        CHECK_OBJ_NOTNULL(pin, EPOCH_PIN_MAGIC);
+        previous = pin->previous;
+        (*pin->release)(pin->ptr);
+        FREE_OBJ(pin);
+        pin = previous;
+    }
+}
+
+static const struct vmod_priv_methods epoch_pins_priv_methods[1] = {{
+    .magic = VMOD_PRIV_METHODS_MAGIC,
+    .type = "epoch_pins",
+    .fini = (vmod_priv_fini_f *)fini_epoch_pins
+}};
+
+// Returns the snapshot in '*ptr', pinned (using 'acquire') until the end of
+// the current task. This way every read in the task (identified by 'id')
+// sees the same snapshot, and values can be returned without copying them
+// to the workspace. If 'refresh' is set, the latest snapshot is pinned if it
+// differs from the one currently pinned. NULL is returned if the task
+// private data is not available (callers should then fall back to
+// enter_epoch() and copy values).
+void *
+pin_epoch_pointer(
+    VRT_CTX, const void *id, void **ptr,
+    void (*acquire)(void *), void (*release)(void *), unsigned refresh)
+{
+    struct vmod_priv *task_priv = VRT_priv_task(ctx, id);
+    if (task_priv == NULL) {
+        return NULL;
+    }
+
+    epoch_pin_t *pin = task_priv->priv;
+    CHECK_OBJ_ORNULL(pin, EPOCH_PIN_MAGIC);
+    if ((pin == NULL) ||
+        (refresh && (pin->ptr != get_epoch_pointer(ptr)))) {
+        epoch_pin_t *result;
+        ALLOC_OBJ(result, EPOCH_PIN_MAGIC);
+        AN(result);
+
+        // The installed snapshot holds a reference until it's released by
+        // reclaim_epochs(), so it's safe to acquire a new one while the
+        // epoch is pinned.
+        epoch_reader_t *reader = enter_epoch();
+        result->ptr = get_epoch_pointer(ptr);
+        AN(result->ptr);
+        (*acquire)(result->ptr);
+        leave_epoch(reader);
+
+        result->release = release;
+        result->previous = pin;
+        task_priv->priv = result;
+        task_priv->methods = epoch_pins_priv_methods;
+        pin = result;
+    }
+
+    return pin->ptr;
+}
+
+/******************************************************************************
+ * WRITERS.
+ *****************************************************************************/
+
+// Releases retired snapshots no longer visible to any reader: the ones
+// retired before the oldest epoch pinned by readers. Must be called while
+// holding 'vmod_state.epochs.mutex'.
+static void
+reclaim_epochs()
+{
+    uint64_t oldest = UINT64_MAX;
+    epoch_reader_t *reader;
+    VTAILQ_FOREACH(reader, &vmod_state.epochs.readers, list) {
+        CHECK_OBJ_NOTNULL(reader, EPOCH_READER_MAGIC);
+        uint64_t epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+        if ((epoch != 0) && (epoch < oldest)) {
+            oldest = epoch;
+        }
+    }
+
+    epoch_retired_t *retired, *retired_tmp;
+    VTAILQ_FOREACH_SAFE(retired, &vmod_state.epochs.retired, list, retired_tmp) {
+        CHECK_OBJ_NOTNULL(retired, EPOCH_RETIRED_MAGIC);
+        if (retired->epoch < oldest) {
+            VTAILQ_REMOVE(&vmod_state.epochs.retired, retired, list);
+            __atomic_sub_fetch(&vmod_state.epochs.nretired, 1, __ATOMIC_SEQ_CST);
+            (*retired->release)(retired->ptr);
+            FREE_OBJ(retired);
+        }
+    }
+}
+
+// Atomically replaces the snapshot in '*ptr' with 'value'. The old snapshot
+// (if any) is released using 'release' once no reader can be using it.
+void
+publish_epoch_pointer(void **ptr, void *value, void (*release)(void *))
+{
+    void *old = __atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST);
+
+    AZ(pthread_mutex_lock(&vmod_state.epochs.mutex));
+    if (old != NULL) {
+        epoch_retired_t *retired;
+        ALLOC_OBJ(retired, EPOCH_RETIRED_MAGIC);
+        AN(retired);
+        retired->ptr = old;
+        retired->release = release;
+        // Readers pinning a later epoch started after the exchange, so they
+        // can't be using the old snapshot.
+        retired->epoch = __atomic_fetch_add(
+            &vmod_state.epochs.epoch, 1, __ATOMIC_SEQ_CST);
+        VTAILQ_INSERT_TAIL(&vmod_state.epochs.retired, retired, list);
+        __atomic_add_fetch(&vmod_state.epochs.nretired, 1, __ATOMIC_SEQ_CST);
+    }
+    reclaim_epochs();
+    AZ(pthread_mutex_unlock(&vmod_state.epochs.mutex));
+}
+
+// Releases retired snapshots no longer visible to any reader, without
+// waiting for the next publish_epoch_pointer(). Cheap when nothing is
+// retired, and never blocks: it's called when leaving epochs, and
+// periodically by the remotes scheduler.
+void
+collect_epochs()
+{
+    if ((__atomic_load_n(&vmod_state.epochs.nretired, __ATOMIC_SEQ_CST) > 0) &&
+        (pthread_mutex_trylock(&vmod_state.epochs.mutex) == 0)) {
+        if (vmod_state.epochs.initialized) {
+            reclaim_epochs();
+        }
+        AZ(pthread_mutex_unlock(&vmod_state.epochs.mutex));
+    }
+}
+
+// Number of retired snapshots still waiting to be released.
+unsigned
+count_retired_epochs()
+{
+    return __atomic_load_n(&vmod_state.epochs.nretired, __ATOMIC_SEQ_CST);
+}
+
+/******************************************************************************
+ * BASICS.
+ *****************************************************************************/
+
+void
+init_epochs()
+{
+    AZ(pthread_mutex_lock(&vmod_state.epochs.mutex));
+    AZ(vmod_state.epochs.initialized);
+    AZ(pthread_key_create(&vmod_state.epochs.key, free_reader));
+    vmod_state.epochs.initialized = 1;
+    AZ(pthread_mutex_unlock(&vmod_state.epochs.mutex));
+}
+
+// Must be called once no VCL is using the VMOD (i.e. there are no readers).
+// Pending snapshots are released, and so are the readers of all threads:
+// the key is deleted, so the VMOD can be safely unloaded before those
+// threads exit.
+void
+fini_epochs()
+{
+    AZ(pthread_mutex_lock(&vmod_state.epochs.mutex));
+    AN(vmod_state.epochs.initialized);
+    AZ(pthread_key_delete(vmod_state.epochs.key));
+    vmod_state.epochs.initialized = 0;
+
+    epoch_reader_t *reader, *reader_tmp;
+    VTAILQ_FOREACH_SAFE(reader, &vmod_state.epochs.readers, list, reader_tmp) {
+        CHECK_OBJ_NOTNULL(reader, EPOCH_READER_MAGIC);
+        AZ(reader->epoch);
+        VTAILQ_REMOVE(&vmod_state.epochs.readers, reader, list);
+        free((void *) reader);
+    }
+
+    reclaim_epochs();
+    AZ(VTAILQ_FIRST(&vmod_state.epochs.retired));
+    AZ(pthread_mutex_unlock(&vmod_state.epochs.mutex));
+}
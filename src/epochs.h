@@ -0,0 +1,64 @@
+#ifndef CFG_EPOCHS_H_INCLUDED
+#define CFG_EPOCHS_H_INCLUDED
+
+// Epoch based reclamation of snapshots (e.g. parsed variables) read by worker
+// threads without locks. Readers pin the current epoch while using a
+// snapshot, writing only to their own (thread-local) state. Writers publish
+// new snapshots atomically and retire the old ones, which are released once
+// every reader that could still be using them has left.
+// Readers are allocated in their own cache line, so pinning epochs doesn't
+// invalidate caches of other threads.
+#define EPOCH_CACHE_LINE 64
+
+typedef struct epoch_reader {
+    unsigned magic;
+    #define EPOCH_READER_MAGIC 0x2b7d90c1
+
+    // Epoch pinned by the reader (0 while not reading). Atomically accessed.
+    uint64_t epoch;
+    // Number of nested enter_epoch() calls. Only accessed by the owner.
+    unsigned depth;
+
+    VTAILQ_ENTRY(epoch_reader) list;
+} __attribute__((aligned(EPOCH_CACHE_LINE))) epoch_reader_t;
+
+typedef struct epoch_retired {
+    unsigned magic;
+    #define EPOCH_RETIRED_MAGIC 0x84c6e35d
+
+    void *ptr;
+    void (*release)(void *);
+    uint64_t epoch;
+
+    VTAILQ_ENTRY(epoch_retired) list;
+} epoch_retired_t;
+
+epoch_reader_t *enter_epoch(void);
+void leave_epoch(epoch_reader_t *reader);
+
+// Snapshots pinned by a task (see pin_epoch_pointer()), released when the
+// task ends. Pins are chained: snapshots pinned before a refresh are kept, as
+// values returned from them may be still in use.
+typedef struct epoch_pin {
+    unsigned magic;
+    #define EPOCH_PIN_MAGIC 0x1c5be8f7
+
+    void *ptr;
+    void (*release)(void *);
+
+    struct epoch_pin *previous;
+} epoch_pin_t;
+
+void *get_epoch_pointer(void **ptr);
+void publish_epoch_pointer(void **ptr, void *value, void (*release)(void *));
+void collect_epochs(void);
+unsigned count_retired_epochs(void);
+
+void *pin_epoch_pointer(
+    VRT_CTX, const void *id, void **ptr,
+    void (*acquire)(void *), void (*release)(void *), unsigned refresh);
+
+void init_epochs(void);
+void fini_epochs(void);
+
+#endif
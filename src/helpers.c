@@ -3,11 +3,36 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "cache/cache.h"
+
 #include "helpers.h"
 
 vmod_state_t vmod_state = {
     .refs = 0,
     .libs.lua = NULL,
     .locks.vsc_seg = NULL,
-    .locks.script = NULL
+    .locks.script = NULL,
+    .remotes.mutex = PTHREAD_MUTEX_INITIALIZER,
+    .remotes.cond = PTHREAD_COND_INITIALIZER,
+    .remotes.warm = 0,
+    .remotes.running = 0,
+    .remotes.multi = NULL,
+    .remotes.worker.running = 0,
+    .remotes.worker.cond = PTHREAD_COND_INITIALIZER,
+    .remotes.worker.queue = VTAILQ_HEAD_INITIALIZER(vmod_state.remotes.worker.queue),
+    .remotes.list = VTAILQ_HEAD_INITIALIZER(vmod_state.remotes.list),
+    .remotes.watcher.fd = -1,
+    .remotes.watcher.pipe = { -1, -1 },
+    .backups.mutex = PTHREAD_MUTEX_INITIALIZER,
+    .backups.cond = PTHREAD_COND_INITIALIZER,
+    .backups.running = 0,
+    .backups.queue = VTAILQ_HEAD_INITIALIZER(vmod_state.backups.queue),
+    .files.mutex = PTHREAD_MUTEX_INITIALIZER,
+    .files.list = VTAILQ_HEAD_INITIALIZER(vmod_state.files.list),
+    .epochs.mutex = PTHREAD_MUTEX_INITIALIZER,
+    .epochs.initialized = 0,
+    .epochs.epoch = 1,
+    .epochs.readers = VTAILQ_HEAD_INITIALIZER(vmod_state.epochs.readers),
+    .epochs.retired = VTAILQ_HEAD_INITIALIZER(vmod_state.epochs.retired),
+    .epochs.nretired = 0
 };
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <syslog.h>
+#include <stdint.h>
+#include <pthread.h>
 
 typedef struct vmod_state {
     unsigned refs;
@@ -14,6 +16,63 @@ typedef struct vmod_state {
         struct vsc_seg *vsc_seg;
         struct VSC_lck *script;
     } locks;
+    struct {
+        // Protects everything in this struct & the 'refresher' field of all
+        // registered remotes.
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        // Number of warm VCLs.
+        unsigned warm;
+        unsigned running;
+        pthread_t thread;
+        // Multi handle of the scheduler (i.e. 'CURLM *') while running.
+        void *multi;
+        // Worker thread of the scheduler, completing reloads (i.e. reading
+        // local files & installing contents) off the multi handle loop.
+        struct {
+            unsigned running;
+            pthread_t thread;
+            pthread_cond_t cond;
+            VTAILQ_HEAD(, remote_transfer) queue;
+        } worker;
+        VTAILQ_HEAD(, remote) list;
+        // inotify watcher of local remotes.
+        struct {
+            int fd;
+            int pipe[2];
+            pthread_t thread;
+        } watcher;
+    } remotes;
+    struct {
+        // Protects everything in this struct & the 'backups' field of all
+        // remotes.
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        unsigned running;
+        pthread_t thread;
+        // Remotes with pending backups.
+        VTAILQ_HEAD(, remote) queue;
+    } backups;
+    struct {
+        // Protects everything in this struct & the 'key', 'refs' and 'list'
+        // fields of all file sources.
+        pthread_mutex_t mutex;
+        // Sources shared by 'file' objects with identical definitions.
+        VTAILQ_HEAD(, file_source) list;
+    } files;
+    struct {
+        // Protects everything in this struct, except 'epoch' and 'nretired'
+        // (atomically accessed).
+        pthread_mutex_t mutex;
+        // Key of the reader of the calling thread (i.e. 'epoch_reader_t *').
+        pthread_key_t key;
+        unsigned initialized;
+        uint64_t epoch;
+        VTAILQ_HEAD(, epoch_reader) readers;
+        // Retired snapshots still visible to some reader.
+        VTAILQ_HEAD(, epoch_retired) retired;
+        unsigned nretired;
+    } epochs;
 } vmod_state_t;
 
 extern vmod_state_t vmod_state;
@@ -3,24 +3,141 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <fnmatch.h>
 #include <curl/curl.h>
 #include <sys/stat.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #include "cache/cache.h"
 #include "vsb.h"
 #include "vcl.h"
+#include "vsha256.h"
 
 #include "helpers.h"
+#include "epochs.h"
 #include "remote.h"
 
-static char *read_backup(VRT_CTX, remote_t *remote);
-static char *read_path(VRT_CTX, remote_t *remote);
-static char *read_url(VRT_CTX, remote_t *remote);
+static char *read_backup(
+    VRT_CTX, remote_t *remote, struct remote_feed *feed);
+static char *read_path(
+    VRT_CTX, remote_t *remote, unsigned conditional, unsigned *unmodified,
+    struct remote_feed *feed);
+static char *read_glob(
+    VRT_CTX, remote_t *remote, unsigned conditional, unsigned *unmodified,
+    struct remote_feed *feed);
+static char *read_url(
+    VRT_CTX, remote_t *remote, unsigned conditional, unsigned *unmodified,
+    struct remote_feed *feed);
+static void close_glob(remote_t *remote, unsigned commit);
+static void queue_backup(VRT_CTX, remote_t *remote, const char *contents);
+static void flush_backup(VRT_CTX, remote_t *remote);
+static void join_loader(remote_t *remote);
+struct read_mirrors_ctx;
+static struct read_mirrors_ctx *start_mirrors(
+    VRT_CTX, remote_t *remote, CURLM *multi, void *priv,
+    unsigned conditional, unsigned watch, struct remote_feed *feed);
+static long poll_mirrors(struct read_mirrors_ctx *ctx);
+static void complete_mirror(
+    struct read_mirrors_ctx *ctx, CURL *ch, CURLcode cr);
+static unsigned is_done_mirrors(struct read_mirrors_ctx *ctx);
+static char *finish_mirrors(struct read_mirrors_ctx *ctx, unsigned *unmodified);
+static uint64_t get_mirrors_time(void);
+static void reset_validators(remote_t *remote);
+static void digest_contents(const char *contents, unsigned char *digest);
+static void set_digest(remote_t *remote, const char *contents);
+static void set_remote_tst(remote_t *remote);
+static remote_user_t *find_remote_user(remote_t *remote, struct vcl *vcl);
+static struct vcl *get_remote_vcl(remote_t *remote);
+static void lock_remote(remote_t *remote, unsigned foreground);
+static void unlock_remote(remote_t *remote, unsigned foreground);
+static void block_remote(remote_t *remote);
+static void unblock_remote(remote_t *remote);
+static void unwatch_remote(remote_t *remote);
+
+// Seeded per process in 'init_remotes()', so different servers don't share
+// the same sequence of reload jitters. Protected by
+// 'vmod_state.remotes.mutex'.
+static unsigned short jitter_seed[3];
+
+// Counters are only updated while reloading the remote, but they may be read
+// at any time by client threads (see get_remote_counter()). Waiting for the
+// reload there would block requests, so counters are atomically accessed
+// instead.
+#define INC_REMOTE_COUNTER(remote, counter, n) \
+    (void) __atomic_add_fetch(&(remote)->stats.counter, (n), __ATOMIC_RELAXED)
+#define GET_REMOTE_COUNTER(remote, counter) \
+    __atomic_load_n(&(remote)->stats.counter, __ATOMIC_RELAXED)
 
 /******************************************************************************
  * BASICS.
  *****************************************************************************/
 
+static unsigned
+is_url_location(const char *location)
+{
+    return
+        (strncmp(location, "http://", 7) == 0) ||
+        (strncmp(location, "https://", 8) == 0);
+}
+
+#define MIRRORS_DELIMITERS " \t\r\n"
+
+// Locations using any scheme other than 'file://', 'http://' and
+// 'https://' are rejected, instead of being handled as local paths. That
+// includes 'backend://' locations: the VMOD API doesn't allow issuing
+// requests through VCL backends or directors. HTTP locations may list
+// several mirrors, all of them using HTTP.
+unsigned
+is_valid_location(VRT_CTX, const char *location)
+{
+    if (is_url_location(location)) {
+        unsigned result = 1;
+        char *copy = strdup(location);
+        AN(copy);
+        char *saveptr;
+        for (char *token = strtok_r(copy, MIRRORS_DELIMITERS, &saveptr);
+             token != NULL;
+             token = strtok_r(NULL, MIRRORS_DELIMITERS, &saveptr)) {
+            if (!is_url_location(token)) {
+                LOG(ctx, LOG_ERR,
+                    "Unsupported mirror (location=%s, mirror=%s)",
+                    location, token);
+                result = 0;
+                break;
+            }
+        }
+        free((void *) copy);
+        return result;
+    }
+
+    const char *ptr = location;
+    if (isalpha(*ptr)) {
+        for (ptr++; isalnum(*ptr) || (*ptr == '+') || (*ptr == '-') || (*ptr == '.'); ptr++);
+        if ((strncmp(ptr, "://", 3) == 0) &&
+            (strncmp(location, "file://", 7) != 0) &&
+            (strncmp(location, "http://", 7) != 0) &&
+            (strncmp(location, "https://", 8) != 0)) {
+            LOG(ctx, LOG_ERR,
+                "Unsupported location scheme (location=%s)",
+                location);
+            return 0;
+        }
+    }
+    return 1;
+}
+
 #define SET_STRING(value, field) \
     do { \
         result->field = strdup(value); \
@@ -42,35 +159,93 @@ static char *read_url(VRT_CTX, remote_t *remote);
         result->read = &read_ ## type; \
     } while (0)
 
+// Whitespace-separated URLs of HTTP locations become mirrors. As usual,
+// 'http://' is stripped from URLs passed to libcurl.
+static void
+set_mirrors(remote_t *remote, const char *location)
+{
+    remote->location.mirrors = NULL;
+    remote->location.nmirrors = 0;
+
+    char *copy = strdup(location);
+    AN(copy);
+    char *saveptr;
+    for (char *token = strtok_r(copy, MIRRORS_DELIMITERS, &saveptr);
+         token != NULL;
+         token = strtok_r(NULL, MIRRORS_DELIMITERS, &saveptr)) {
+        remote->location.mirrors = realloc(
+            remote->location.mirrors,
+            (remote->location.nmirrors + 1) * sizeof(remote_mirror_t));
+        AN(remote->location.mirrors);
+        remote_mirror_t *mirror =
+            &remote->location.mirrors[remote->location.nmirrors++];
+        mirror->raw = strdup(token);
+        AN(mirror->raw);
+        mirror->parsed = strdup(
+            (strncmp(token, "http://", 7) == 0) ? token + 7 : token);
+        AN(mirror->parsed);
+        mirror->handle = NULL;
+    }
+    free((void *) copy);
+
+    AN(remote->location.nmirrors);
+}
+
+#undef MIRRORS_DELIMITERS
+
 remote_t *
 new_remote(
-    const char *location, const char *backup, unsigned automated_backups,
-    unsigned period, unsigned curl_connection_timeout,
-    unsigned curl_transfer_timeout, unsigned curl_ssl_verify_peer,
-    unsigned curl_ssl_verify_host, const char *curl_ssl_cafile,
-    const char *curl_ssl_capath, const char *curl_proxy)
+    VRT_CTX, const char *location, const char *backup,
+    unsigned automated_backups, unsigned period, unsigned keep_contents,
+    unsigned curl_connection_timeout, unsigned curl_transfer_timeout,
+    unsigned curl_ssl_verify_peer, unsigned curl_ssl_verify_host,
+    const char *curl_ssl_cafile, const char *curl_ssl_capath,
+    const char *curl_proxy, unsigned curl_http2, unsigned curl_compression,
+    unsigned curl_max_body_size, unsigned curl_watch_timeout,
+    unsigned curl_hedge_delay,
+    unsigned (*callback)(VRT_CTX, void *, char *, unsigned),
+    const remote_stream_t *stream,
+    unsigned (*parts)(VRT_CTX, void *, const remote_part_t *, unsigned),
+    unsigned (*patch)(VRT_CTX, void *, unsigned, const char *),
+    void *ptr)
 {
     remote_t *result;
     ALLOC_OBJ(result, REMOTE_MAGIC);
     AN(result);
 
     SET_STRING(location, location.raw);
+    result->location.mirrors = NULL;
+    result->location.nmirrors = 0;
     if (strncmp(location, "file://", 7) == 0) {
         SET_LOCATION(path, 7);
-    } else if (strncmp(location, "http://", 7) == 0) {
-        SET_LOCATION(url, 7);
-    } else if (strncmp(location, "https://", 8) == 0) {
-        SET_LOCATION(url, 0);
+    } else if (is_url_location(location)) {
+        set_mirrors(result, location);
+        SET_STRING(result->location.mirrors[0].parsed, location.parsed);
+        result->read = &read_url;
     } else {
         SET_LOCATION(path, 0);
     }
+    if ((result->read == &read_path) &&
+        (strpbrk(result->location.parsed, "*?[") != NULL)) {
+        result->read = &read_glob;
+    }
     if ((backup != NULL) && (strlen(backup) > 0)) {
-        SET_STRING(backup, backup);
+        if ((result->read == &read_glob) && (parts != NULL)) {
+            // Files are parsed one by one, so there is no single document
+            // that could be written to (and then restored from) a backup.
+            LOG(ctx, LOG_ERR,
+                "Backups are not supported by glob locations (location=%s, backup=%s)",
+                location, backup);
+            result->backup = NULL;
+        } else {
+            SET_STRING(backup, backup);
+        }
     } else {
         result->backup = NULL;
     }
     result->automated_backups = automated_backups;
     result->period = period;
+    result->keep_contents = keep_contents;
     result->curl.connection_timeout = curl_connection_timeout;
     result->curl.transfer_timeout = curl_transfer_timeout;
     result->curl.ssl_verify_peer = curl_ssl_verify_peer;
@@ -78,10 +253,50 @@ new_remote(
     SET_OPTIONAL_STRING(curl_ssl_cafile, curl.ssl_cafile);
     SET_OPTIONAL_STRING(curl_ssl_capath, curl.ssl_capath);
     SET_OPTIONAL_STRING(curl_proxy, curl.proxy);
+    result->curl.http2 = curl_http2;
+    result->curl.compression = curl_compression;
+    result->curl.max_body_size = curl_max_body_size;
+    result->curl.watch_timeout = curl_watch_timeout;
+    result->curl.hedge_delay = curl_hedge_delay;
+    result->callback = callback;
+    result->stream = stream;
+    result->parts = parts;
+    result->patch = patch;
+    result->ptr = ptr;
     result->state.tst = 0;
     AZ(pthread_mutex_init(&result->state.mutex, NULL));
-    result->state.reloading = 0;
     result->state.contents = NULL;
+    result->state.validators.etag = NULL;
+    result->state.validators.last_modified = NULL;
+    result->state.validators.index = NULL;
+    result->state.validators.file.set = 0;
+    result->state.patch = REMOTE_PATCH_NONE;
+    result->state.glob.parts = NULL;
+    result->state.glob.nparts = 0;
+    result->state.glob.pending = NULL;
+    result->state.glob.npending = 0;
+    result->state.digest.set = 0;
+    memset(&result->stats, 0, sizeof(result->stats));
+    result->backups.pending = NULL;
+    result->backups.queued = 0;
+    result->backups.busy = 0;
+    memset(&result->backups.stats, 0, sizeof(result->backups.stats));
+    result->loader.status = REMOTE_LOADER_IDLE;
+    VTAILQ_INIT(&result->refresher.users);
+    result->refresher.warm = 0;
+    result->refresher.busy = 0;
+    result->refresher.reloading = 0;
+    result->refresher.blocked = 0;
+    result->refresher.dirty = 0;
+    result->refresher.wd = -1;
+    result->refresher.next = 0;
+    result->refresher.failures = 0;
+
+    AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    VTAILQ_INSERT_TAIL(&vmod_state.remotes.list, result, refresher.list);
+    AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+
+    share_remote(ctx, result);
 
     return result;
 }
@@ -108,11 +323,37 @@ free_remote(remote_t *remote)
 {
     CHECK_OBJ_NOTNULL(remote, REMOTE_MAGIC);
 
+    join_loader(remote);
+
+    // Wait for any in-progress background reload before unregistering the
+    // remote.
+    AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    if (remote->refresher.busy) {
+        block_remote(remote);
+        while (remote->refresher.busy) {
+            AZ(pthread_cond_wait(&vmod_state.remotes.cond, &vmod_state.remotes.mutex));
+        }
+        unblock_remote(remote);
+    }
+    VTAILQ_REMOVE(&vmod_state.remotes.list, remote, refresher.list);
+    unwatch_remote(remote);
+    AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+
+    // Don't lose pending backups.
+    struct vrt_ctx ctx;
+    INIT_OBJ(&ctx, VRT_CTX_MAGIC);
+    flush_backup(&ctx, remote);
+    AZ(remote->backups.pending);
+    AZ(remote->backups.queued);
+    AZ(remote->backups.busy);
+    memset(&remote->backups.stats, 0, sizeof(remote->backups.stats));
+
     FREE_STRING(location.raw);
     FREE_STRING(location.parsed);
     remote->backup = NULL;
     remote->automated_backups = 0;
     remote->period = 0;
+    remote->keep_contents = 0;
     remote->curl.connection_timeout = 0;
     remote->curl.transfer_timeout = 0;
     remote->curl.ssl_verify_peer = 0;
@@ -120,11 +361,53 @@ free_remote(remote_t *remote)
     FREE_OPTIONAL_STRING(curl.ssl_cafile);
     FREE_OPTIONAL_STRING(curl.ssl_capath);
     FREE_OPTIONAL_STRING(curl.proxy);
+    remote->curl.http2 = 0;
+    remote->curl.compression = 0;
+    remote->curl.max_body_size = 0;
+    remote->curl.watch_timeout = 0;
+    remote->curl.hedge_delay = 0;
+    for (unsigned i = 0; i < remote->location.nmirrors; i++) {
+        remote_mirror_t *mirror = &remote->location.mirrors[i];
+        free((void *) mirror->raw);
+        free((void *) mirror->parsed);
+        if (mirror->handle != NULL) {
+            curl_easy_cleanup(mirror->handle);
+        }
+    }
+    free((void *) remote->location.mirrors);
+    remote->location.mirrors = NULL;
+    remote->location.nmirrors = 0;
     remote->read = NULL;
+    remote->callback = NULL;
+    remote->stream = NULL;
+    remote->parts = NULL;
+    remote->patch = NULL;
+    remote->ptr = NULL;
     remote->state.tst = 0;
     AZ(pthread_mutex_destroy(&remote->state.mutex));
-    remote->state.reloading = 0;
     FREE_OPTIONAL_STRING(state.contents);
+    reset_validators(remote);
+    AZ(remote->state.glob.pending);
+    for (unsigned i = 0; i < remote->state.glob.nparts; i++) {
+        free((void *) remote->state.glob.parts[i].path);
+        free((void *) remote->state.glob.parts[i].contents);
+    }
+    free((void *) remote->state.glob.parts);
+    remote->state.glob.parts = NULL;
+    remote->state.glob.nparts = 0;
+    remote->state.digest.set = 0;
+    memset(&remote->stats, 0, sizeof(remote->stats));
+    remote_user_t *iuser, *iuser_tmp;
+    VTAILQ_FOREACH_SAFE(iuser, &remote->refresher.users, list, iuser_tmp) {
+        CHECK_OBJ_NOTNULL(iuser, REMOTE_USER_MAGIC);
+        VTAILQ_REMOVE(&remote->refresher.users, iuser, list);
+        FREE_OBJ(iuser);
+    }
+    remote->refresher.warm = 0;
+    remote->refresher.dirty = 0;
+    remote->refresher.wd = -1;
+    remote->refresher.next = 0;
+    remote->refresher.failures = 0;
 
     FREE_OBJ(remote);
 }
@@ -132,22 +415,343 @@ free_remote(remote_t *remote)
 #undef FREE_STRING
 #undef FREE_OPTIONAL_STRING
 
+// Registers the VCL as a user of the remote. Periodical reloads of the remote
+// are executed while any of its users is warm.
+void
+share_remote(VRT_CTX, remote_t *remote)
+{
+    CHECK_OBJ_NOTNULL(remote, REMOTE_MAGIC);
+
+    AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    remote_user_t *user = find_remote_user(remote, ctx->vcl);
+    if (user == NULL) {
+        ALLOC_OBJ(user, REMOTE_USER_MAGIC);
+        AN(user);
+        user->vcl = ctx->vcl;
+        user->refs = 0;
+        user->warm = 0;
+        VTAILQ_INSERT_TAIL(&remote->refresher.users, user, list);
+    }
+    user->refs++;
+    AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+}
+
+void
+unshare_remote(remote_t *remote, struct vcl *vcl)
+{
+    CHECK_OBJ_NOTNULL(remote, REMOTE_MAGIC);
+
+    AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    remote_user_t *user = find_remote_user(remote, vcl);
+    CHECK_OBJ_NOTNULL(user, REMOTE_USER_MAGIC);
+    assert(user->refs > 0);
+    if (--user->refs == 0) {
+        // Objects are discarded once the VCL is cold, so the scheduler can't
+        // be working on behalf of this user.
+        if (user->warm) {
+            assert(remote->refresher.warm > 0);
+            remote->refresher.warm--;
+        }
+        VTAILQ_REMOVE(&remote->refresher.users, user, list);
+        FREE_OBJ(user);
+
+        // Watched again if some VCL starts using the remote again (see
+        // warm_remotes()).
+        if (VTAILQ_EMPTY(&remote->refresher.users)) {
+            unwatch_remote(remote);
+        }
+    }
+    AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+}
+
 /******************************************************************************
- * CHECK.
+ * FEEDS.
  *****************************************************************************/
 
+struct remote_feed {
+    remote_t *remote;
+    unsigned is_backup;
+
+    // Parsing state. NULL until parsing starts.
+    void *state;
+    unsigned failed;
+
+    // Number of bytes fed so far.
+    size_t fed;
+
+    // Set when fed contents don't need to be kept: they are neither kept
+    // once parsed (see 'keep_contents') nor backed up. Readers then drop
+    // bytes once fed, and changes are detected using the digest of the fed
+    // contents. See is_discarding_feed().
+    unsigned discard;
+    struct {
+        struct SHA256Context ctx;
+        unsigned char value[SHA256_LEN];
+        unsigned final;
+    } digest;
+
+    // Installed contents. Parsing is deferred while fed contents are a prefix
+    // of the installed ones, so unchanged contents are never parsed again.
+    struct {
+        const char *contents;
+        size_t len;
+        size_t matched;
+    } installed;
+
+    // Pending (i.e. still not terminated) line.
+    struct {
+        char *ptr;
+        size_t len;
+        size_t size;
+    } line;
+};
+
+static void
+init_feed(
+    struct remote_feed *feed, remote_t *remote, unsigned is_backup,
+    const char *installed)
+{
+    AN(remote->stream);
+    feed->remote = remote;
+    feed->is_backup = is_backup;
+    feed->state = NULL;
+    feed->failed = 0;
+    feed->fed = 0;
+    // Glob locations read files on their own, and files parsed one by one
+    // are not fed at all.
+    feed->discard =
+        !is_backup &&
+        !remote->keep_contents &&
+        (remote->backup == NULL) &&
+        (remote->read != &read_glob);
+    if (feed->discard) {
+        SHA256_Init(&feed->digest.ctx);
+        feed->digest.final = 0;
+    }
+    feed->installed.contents = installed;
+    feed->installed.len = (installed != NULL) ? strlen(installed) : 0;
+    feed->installed.matched = 0;
+    feed->line.ptr = NULL;
+    feed->line.len = 0;
+    feed->line.size = 0;
+}
+
+static void
+feed_line(VRT_CTX, struct remote_feed *feed)
+{
+    remote_t *remote = feed->remote;
+
+    if ((feed->line.len > 0) && (feed->line.ptr[feed->line.len - 1] == '\r')) {
+        feed->line.ptr[--feed->line.len] = '\0';
+    }
+    if (!feed->failed &&
+        !(*remote->stream->line)(ctx, remote->ptr, feed->state, feed->line.ptr)) {
+        feed->failed = 1;
+    }
+    feed->line.len = 0;
+}
+
+static void
+parse_feed(VRT_CTX, struct remote_feed *feed, const char *data, size_t len)
+{
+    remote_t *remote = feed->remote;
+
+    if (feed->state == NULL) {
+        feed->state = (*remote->stream->start)(ctx, remote->ptr);
+        AN(feed->state);
+    }
+
+    while ((len > 0) && !feed->failed) {
+        const char *eol = memchr(data, '\n', len);
+        size_t n = (eol != NULL) ? (size_t) (eol - data) : len;
+
+        if (feed->line.len + n + 1 > feed->line.size) {
+            feed->line.size = 2 * (feed->line.len + n + 1);
+            feed->line.ptr = realloc(feed->line.ptr, feed->line.size);
+            AN(feed->line.ptr);
+        }
+        memcpy(feed->line.ptr + feed->line.len, data, n);
+        feed->line.len += n;
+        feed->line.ptr[feed->line.len] = '\0';
+
+        if (eol != NULL) {
+            feed_line(ctx, feed);
+            data += n + 1;
+            len -= n + 1;
+        } else {
+            len = 0;
+        }
+    }
+}
+
+static void
+feed_remote(VRT_CTX, struct remote_feed *feed, const char *data, size_t len)
+{
+    if ((feed == NULL) || (len == 0)) {
+        return;
+    }
+
+    feed->fed += len;
+    if (feed->discard) {
+        AZ(feed->digest.final);
+        SHA256_Update(&feed->digest.ctx, data, len);
+    }
+
+    if ((feed->state == NULL) && (feed->installed.contents != NULL)) {
+        size_t left = feed->installed.len - feed->installed.matched;
+        if ((len <= left) &&
+            (memcmp(data, feed->installed.contents + feed->installed.matched, len) == 0)) {
+            feed->installed.matched += len;
+            return;
+        }
+
+        // Contents diverge: parse the identical prefix first.
+        parse_feed(ctx, feed, feed->installed.contents, feed->installed.matched);
+    }
+
+    parse_feed(ctx, feed, data, len);
+}
+
+static unsigned
+is_discarding_feed(struct remote_feed *feed)
+{
+    return (feed != NULL) && feed->discard;
+}
+
+// Digest of all fed contents. Only available when discarding them, and once
+// they have been completely fed.
+static const unsigned char *
+get_feed_digest(struct remote_feed *feed)
+{
+    AN(feed->discard);
+    if (!feed->digest.final) {
+        SHA256_Final(feed->digest.value, &feed->digest.ctx);
+        feed->digest.final = 1;
+    }
+    return feed->digest.value;
+}
+
+static unsigned
+is_identical_feed(struct remote_feed *feed)
+{
+    return
+        (feed->state == NULL) &&
+        (feed->installed.contents != NULL) &&
+        (feed->fed > 0) &&
+        (feed->installed.matched == feed->installed.len);
+}
+
 static unsigned
-check_remote_backup(
-    VRT_CTX, remote_t *remote,
-    unsigned (*callback)(VRT_CTX, void *, char *, unsigned), void *ptr)
+close_feed(VRT_CTX, struct remote_feed *feed, unsigned commit)
 {
     unsigned result = 0;
-    char *contents = read_backup(ctx, remote);
+    remote_t *remote = feed->remote;
+
+    if (commit && (feed->fed > 0) && (feed->state == NULL)) {
+        // Fed contents are a prefix of (or identical to) the installed ones.
+        parse_feed(ctx, feed, feed->installed.contents, feed->installed.matched);
+    }
+
+    if (feed->state != NULL) {
+        if (commit && (feed->line.len > 0)) {
+            feed_line(ctx, feed);
+        }
+        result = (*remote->stream->finish)(
+            ctx, remote->ptr, feed->state, feed->is_backup,
+            commit && !feed->failed);
+        feed->state = NULL;
+    }
+
+    free((void *) feed->line.ptr);
+    feed->line.ptr = NULL;
+    feed->line.len = 0;
+    feed->line.size = 0;
+
+    return result;
+}
+
+static unsigned
+parse_remote(
+    VRT_CTX, remote_t *remote, struct remote_feed *feed, char *contents,
+    unsigned is_backup)
+{
+    // Discarded contents are empty, but have been fed.
+    unsigned commit =
+        (contents != NULL) &&
+        ((strlen(contents) > 0) ||
+         (is_discarding_feed(feed) && (feed->fed > 0)));
+    if (commit && (remote->state.glob.pending != NULL) && (remote->parts != NULL)) {
+        if (feed != NULL) {
+            close_feed(ctx, feed, 0);
+        }
+        return (*remote->parts)(
+            ctx, remote->ptr,
+            remote->state.glob.pending, remote->state.glob.npending);
+    } else if (feed != NULL) {
+        return close_feed(ctx, feed, commit);
+    } else if (commit) {
+        return (*remote->callback)(ctx, remote->ptr, contents, is_backup);
+    }
+    return 0;
+}
+
+/******************************************************************************
+ * CHECK.
+ *****************************************************************************/
+
+static void
+release_contents(remote_t *remote)
+{
+    AZ(pthread_mutex_lock(&remote->state.mutex));
+    if (remote->state.contents != NULL) {
+        free((void *) remote->state.contents);
+        remote->state.contents = NULL;
+    }
+    AZ(pthread_mutex_unlock(&remote->state.mutex));
+}
+
+// Applies a patch relative to the installed contents. Raw contents of the
+// remote are discarded afterwards, since they don't match the installed
+// ones anymore (i.e. '.inspect()' falls back to the installed variables and
+// no backups are written until the next complete fetch).
+static unsigned
+patch_remote(VRT_CTX, remote_t *remote, unsigned patch, const char *contents)
+{
+    unsigned result = (*remote->patch)(ctx, remote->ptr, patch, contents);
+
+    if (result) {
+        INC_REMOTE_COUNTER(remote, fetches.patched, 1);
+
+        release_contents(remote);
+        remote->state.digest.set = 0;
+
+        LOG(ctx, LOG_INFO,
+            "Patch applied (location=%s, type=%s)",
+            remote->location.raw,
+            (patch == REMOTE_PATCH_MERGE) ? "merge-patch" : "json-patch");
+    } else {
+        INC_REMOTE_COUNTER(remote, fetches.diverged, 1);
+
+        LOG(ctx, LOG_ERR,
+            "Failed to apply patch, fetching complete contents (location=%s)",
+            remote->location.raw);
+    }
+
+    return result;
+}
 
-    if (contents != NULL && strlen(contents) > 0) {
-        result = (*callback)(ctx, ptr, contents, 1);
+static unsigned
+check_remote_backup(VRT_CTX, remote_t *remote)
+{
+    struct remote_feed feed, *pfeed = NULL;
+    if (remote->stream != NULL) {
+        init_feed(&feed, remote, 1, NULL);
+        pfeed = &feed;
     }
 
+    char *contents = read_backup(ctx, remote, pfeed);
+    unsigned result = parse_remote(ctx, remote, pfeed, contents, 1);
+
     if (result) {
         AZ(pthread_mutex_lock(&remote->state.mutex));
         if (remote->state.contents != NULL) {
@@ -155,6 +759,10 @@ check_remote_backup(
         }
         remote->state.contents = contents;
         AZ(pthread_mutex_unlock(&remote->state.mutex));
+        set_digest(remote, contents);
+        if (!remote->keep_contents) {
+            release_contents(remote);
+        }
 
         LOG(ctx, LOG_INFO,
             "Settings loaded from backup (location=%s, backup=%s)",
@@ -172,32 +780,154 @@ check_remote_backup(
     return result;
 }
 
-unsigned
-check_remote(
-    VRT_CTX, remote_t *remote, unsigned force_load, unsigned force_backup,
-    unsigned (*callback)(VRT_CTX, void *, char *, unsigned), void *ptr)
+// In-progress reload of a remote. Reloads start with begin_reload(), which
+// locks the remote, and end with end_reload(), which unlocks it. In between,
+// contents must be read using 'feed'.
+struct remote_reload {
+    remote_t *remote;
+    unsigned force_backup;
+    unsigned conditional;
+    // Set for reloads not executed by the scheduler. See lock_remote().
+    unsigned foreground;
+    // Set when contents have been pushed (see update_remote()) instead of
+    // being read from the remote location.
+    unsigned pushed;
+    unsigned unmodified;
+    // Set when contents couldn't be fetched or parsed (even if contents were
+    // then loaded from the backup file).
+    unsigned failed;
+    struct remote_feed *feed;
+    struct remote_feed stream;
+};
+
+static void
+begin_reload(
+    struct remote_reload *reload, remote_t *remote, unsigned force_backup,
+    unsigned conditional, unsigned foreground)
+{
+    lock_remote(remote, foreground);
+
+    reload->remote = remote;
+    reload->force_backup = force_backup;
+    reload->conditional = conditional;
+    reload->foreground = foreground;
+    reload->pushed = 0;
+    reload->unmodified = 0;
+    reload->failed = 0;
+
+    // Installed contents are only replaced while reloading the remote, so
+    // no need to lock 'state.mutex' here.
+    if (remote->stream != NULL) {
+        init_feed(
+            &reload->stream, remote, 0,
+            conditional ? remote->state.contents : NULL);
+        reload->feed = &reload->stream;
+    } else {
+        reload->feed = NULL;
+    }
+}
+
+static unsigned
+end_reload(VRT_CTX, struct remote_reload *reload, char *contents)
 {
     unsigned result = 0;
+    remote_t *remote = reload->remote;
+    unsigned force_backup = reload->force_backup;
+    unsigned conditional = reload->conditional;
+    unsigned unmodified = reload->unmodified;
+    struct remote_feed *pfeed = reload->feed;
+    unsigned patch = remote->state.patch;
+    unsigned patched = 0;
 
-    time_t now = time(NULL);
-    unsigned winner = 0;
+    remote->state.patch = REMOTE_PATCH_NONE;
 
-    if (!force_load &&
-        !remote->state.reloading &&
-        ((remote->period > 0) && (now - remote->state.tst > remote->period))) {
-        AZ(pthread_mutex_lock(&remote->state.mutex));
-        if (!remote->state.reloading) {
-            remote->state.reloading = 1;
-            winner = 1;
+    // Patches are applied to the installed contents. If versions diverged
+    // (or the patch is broken), the remote is fetched again completely, and
+    // only that fetch is accounted as modified (or failed).
+    if (patch != REMOTE_PATCH_NONE) {
+        AN(contents);
+        patched = patch_remote(ctx, remote, patch, contents);
+        free((void *) contents);
+        contents = NULL;
+        if (patched) {
+            INC_REMOTE_COUNTER(remote, fetches.modified, 1);
+        } else {
+            reset_validators(remote);
+            contents = (*remote->read)(ctx, remote, 0, &unmodified, pfeed);
+            AZ(remote->state.patch);
+        }
+    }
+
+    // Skip parsing, swapping & backups when fetched contents are identical
+    // to the installed ones. Not for files of glob locations parsed one by
+    // one: identical concatenated contents don't imply identical files.
+    if (conditional &&
+        (contents != NULL) &&
+        ((remote->state.glob.pending == NULL) || (remote->parts == NULL))) {
+        if ((pfeed != NULL) && (pfeed->installed.contents != NULL)) {
+            if (is_identical_feed(pfeed)) {
+                free((void *) contents);
+                contents = NULL;
+                unmodified = 1;
+            }
+        } else if (is_discarding_feed(pfeed)) {
+            if (remote->state.digest.set &&
+                (memcmp(get_feed_digest(pfeed), remote->state.digest.value, SHA256_LEN) == 0)) {
+                free((void *) contents);
+                contents = NULL;
+                unmodified = 1;
+            }
+        } else if (remote->state.digest.set) {
+            unsigned char digest[SHA256_LEN];
+            digest_contents(contents, digest);
+            if (memcmp(digest, remote->state.digest.value, SHA256_LEN) == 0) {
+                free((void *) contents);
+                contents = NULL;
+                unmodified = 1;
+            }
         }
-        AZ(pthread_mutex_unlock(&remote->state.mutex));
     }
 
-    if (force_load || winner) {
-        char *contents = (*remote->read)(ctx, remote);
+    if (patched) {
+        AZ(contents);
+        if (pfeed != NULL) {
+            close_feed(ctx, pfeed, 0);
+        }
+        result = 1;
+    } else if (unmodified) {
+        AZ(contents);
+        reload->unmodified = 1;
+        if (pfeed != NULL) {
+            close_feed(ctx, pfeed, 0);
+        }
+        if (reload->pushed) {
+            INC_REMOTE_COUNTER(remote, updates.accepted, 1);
+        } else {
+            INC_REMOTE_COUNTER(remote, fetches.unmodified, 1);
+        }
+        result = 1;
+
+        LOG(ctx, LOG_INFO,
+            "Remote not modified (location=%s)",
+            remote->location.raw);
+    } else {
+        if (!reload->pushed) {
+            if (contents != NULL) {
+                INC_REMOTE_COUNTER(remote, fetches.modified, 1);
+            } else {
+                INC_REMOTE_COUNTER(remote, fetches.failed, 1);
+            }
+        }
+
+        result = parse_remote(ctx, remote, pfeed, contents, 0);
+        reload->failed = !result;
 
-        if (contents != NULL && strlen(contents) > 0) {
-            result = (*callback)(ctx, ptr, contents, 0);
+        if (reload->pushed) {
+            if (result) {
+                INC_REMOTE_COUNTER(remote, updates.accepted, 1);
+            } else {
+                INC_REMOTE_COUNTER(remote, updates.rejected, 1);
+            }
         }
 
         if (result) {
@@ -207,59 +937,47 @@ check_remote(
             }
             remote->state.contents = contents;
             AZ(pthread_mutex_unlock(&remote->state.mutex));
+            if (is_discarding_feed(pfeed)) {
+                memcpy(remote->state.digest.value, get_feed_digest(pfeed), SHA256_LEN);
+                remote->state.digest.set = 1;
+            } else {
+                set_digest(remote, contents);
+            }
 
             if (remote->backup != NULL) {
                 if (remote->automated_backups || force_backup) {
-                    FILE *backup = fopen(remote->backup, "wb");
-                    if (backup != NULL) {
-                        int rc = fputs(contents, backup);
-                        if (rc < 0) {
-                            // Not possible to use GNU strerror_r() due to Linux Alpine
-                            // issue. See:
-                            //   - https://stackoverflow.com/questions/41953104/strerror-r-is-incorrectly-declared-on-alpine-linux
-                            char buffer[256];
-#ifdef STRERROR_R_CHAR_P
-                            LOG(ctx, LOG_ERR,
-                                "Failed to write backup file (location=%s, backup=%s, error=%s)",
-                                remote->location.raw, remote->backup, strerror_r(rc, buffer, sizeof(buffer)));
-#else
-                            rc = strerror_r(rc, buffer, sizeof(buffer));
-                            if (rc == 0) {
-                                LOG(ctx, LOG_ERR,
-                                    "Failed to write backup file (location=%s, backup=%s, error=%s)",
-                                    remote->location.raw, remote->backup, buffer);
-                            } else {
-                                LOG(ctx, LOG_ERR,
-                                    "Failed to write backup file (location=%s, backup=%s, error=%d)",
-                                    remote->location.raw, remote->backup, rc);
-                            }
-#endif
-                        } else {
-                            LOG(ctx, LOG_INFO,
-                                "Successfully write to backup file (location=%s, backup=%s)",
-                                remote->location.raw, remote->backup);
-                        }
-                        fclose(backup);
-                    } else {
-                        LOG(ctx, LOG_ERR,
-                            "Failed to open backup file (location=%s, backup=%s)",
-                            remote->location.raw, remote->backup);
-                    }
+                    queue_backup(ctx, remote, contents);
                 } else {
                     LOG(ctx, LOG_INFO,
                         "Automated backups are disabled (location=%s, backup=%s)",
                         remote->location.raw, remote->backup);
                 }
             }
+
+            if (!remote->keep_contents) {
+                release_contents(remote);
+            }
+        } else if (reload->pushed) {
+            // Rejected pushes leave installed contents untouched.
+            if (contents != NULL) {
+                free((void *) contents);
+            }
         } else {
             if (contents != NULL) {
                 free((void *) contents);
             }
 
+            // Validators are only meaningful while installed contents match
+            // the last successfully loaded response.
+            reset_validators(remote);
+
             if (remote->backup != NULL) {
+                // Backups still being written are the most recent ones.
+                flush_backup(ctx, remote);
+
                 struct stat st;
                 if ((stat(remote->backup, &st) == 0) && (st.st_size > 0)) {
-                    result = check_remote_backup(ctx, remote, callback, ptr);
+                    result = check_remote_backup(ctx, remote);
                 } else {
                     LOG(ctx, LOG_ERR,
                         "Backup file is empty or doesn't exist (location=%s, backup=%s)",
@@ -267,68 +985,1334 @@ check_remote(
                 }
             }
         }
+    }
 
-        if (result || winner) {
-            AZ(pthread_mutex_lock(&remote->state.mutex));
-            if (result) {
-                remote->state.tst = time(NULL);
-            }
-            if (winner) {
-                remote->state.reloading = 0;
-            }
-            AZ(pthread_mutex_unlock(&remote->state.mutex));
-        }
-    } else {
-        result = 1;
+    if (result) {
+        set_remote_tst(remote);
     }
 
+    close_glob(remote, !reload->failed);
+
+    unlock_remote(remote, reload->foreground);
+
     return result;
 }
 
-/******************************************************************************
- * INSPECT.
- *****************************************************************************/
-
-void
-inspect_remote(VRT_CTX, remote_t *remote)
+// Aborts an in-progress reload leaving everything untouched (e.g. cancelled
+// long polls).
+static void
+cancel_reload(VRT_CTX, struct remote_reload *reload)
 {
-    if ((ctx->method == VCL_MET_SYNTH) ||
-        (ctx->method == VCL_MET_BACKEND_ERROR)) {
-        struct vsb *vsb = NULL;
-        CAST_OBJ_NOTNULL(vsb, ctx->specific, VSB_MAGIC);
-
-        AZ(pthread_mutex_lock(&remote->state.mutex));
-        if (remote->state.contents != NULL) {
-            AZ(VSB_cat(vsb, remote->state.contents));
-        }
-        AZ(pthread_mutex_unlock(&remote->state.mutex));
+    if (reload->feed != NULL) {
+        close_feed(ctx, reload->feed, 0);
     }
+    close_glob(reload->remote, 0);
+    unlock_remote(reload->remote, reload->foreground);
 }
 
-/******************************************************************************
- * HELPERS.
- *****************************************************************************/
+static unsigned
+reload_remote(
+    VRT_CTX, remote_t *remote, unsigned force_backup, unsigned conditional)
+{
+    struct remote_reload reload;
+    begin_reload(&reload, remote, force_backup, conditional, 1);
+    char *contents = (*remote->read)(
+        ctx, remote, conditional, &reload.unmodified, reload.feed);
+    return end_reload(ctx, &reload, contents);
+}
 
-static char *
-read_file(VRT_CTX, remote_t *remote, const char *file)
+static void
+set_remote_tst(remote_t *remote)
 {
-    char *result = NULL;
+    __atomic_store_n(&remote->state.tst, time(NULL), __ATOMIC_RELEASE);
+}
 
-    FILE *bf = fopen(file, "rb");
-    if (bf != NULL) {
-        fseek(bf, 0, SEEK_END);
-        unsigned long fsize = ftell(bf);
-        fseek(bf, 0, SEEK_SET);
+// Time of the last successful load (0 if none). Atomically accessed, so
+// lookups by client threads (see check_remote()) don't lock anything.
+static time_t
+get_remote_tst(remote_t *remote)
+{
+    return __atomic_load_n(&remote->state.tst, __ATOMIC_ACQUIRE);
+}
 
-        result = malloc(fsize + 1);
-        AN(result);
-        size_t nitems = fread(result, 1, fsize, bf);
-        fclose(bf);
-        result[fsize] = '\0';
+unsigned
+check_remote(
+    VRT_CTX, remote_t *remote, unsigned force_load, unsigned force_backup)
+{
+    // First use of the remote: wait for the initial load, if any.
+    join_loader(remote);
 
-        if (nitems != fsize) {
-            free((void *) result);
-            result = NULL;
+    // Periodical reloads are handled by the refresher thread. Unless
+    // explicitly requested, this never triggers any I/O: it simply reports
+    // if some contents have been successfully loaded.
+    if (force_load) {
+        return reload_remote(ctx, remote, force_backup, 0);
+    } else {
+        return get_remote_tst(remote) > 0;
+    }
+}
+
+struct remote_update {
+    const struct vrt_ctx *ctx;
+    struct remote_feed *feed;
+    char *body;
+    size_t bodylen;
+    size_t bodysize;
+};
+
+static int
+update_remote_body(void *priv, unsigned flush, const void *ptr, ssize_t len)
+{
+    struct remote_update *update = (struct remote_update *) priv;
+
+    if (len > 0) {
+        if (update->bodylen + len + 1 > update->bodysize) {
+            while (update->bodylen + len + 1 > update->bodysize) {
+                update->bodysize *= 2;
+            }
+            update->body = realloc(update->body, update->bodysize);
+            AN(update->body);
+        }
+        memcpy(update->body + update->bodylen, ptr, len);
+        update->bodylen += len;
+        update->body[update->bodylen] = '\0';
+
+        if (update->feed != NULL) {
+            feed_remote(update->ctx, update->feed, ptr, len);
+        }
+    }
+
+    return 0;
+}
+
+// Installs the (previously cached) body of the current client request as the
+// new contents of the remote. Contents are validated and parsed exactly as
+// fetched ones, but failures leave installed contents untouched.
+unsigned
+update_remote(VRT_CTX, remote_t *remote, unsigned force_backup)
+{
+    if ((ctx->req == NULL) ||
+        (ctx->req->req_body_status != BS_CACHED)) {
+        LOG(ctx, LOG_ERR,
+            "Request body must be cached before updating remote (location=%s)",
+            remote->location.raw);
+        return 0;
+    }
+
+    join_loader(remote);
+
+    struct remote_reload reload;
+    begin_reload(&reload, remote, force_backup, 1, 1);
+    reload.pushed = 1;
+
+    struct remote_update update = {
+        .ctx = ctx,
+        .feed = reload.feed,
+        .bodylen = 0,
+        .bodysize = (ctx->req->req_bodybytes > 0) ?
+            ctx->req->req_bodybytes + 1 : 1
+    };
+    update.body = malloc(update.bodysize);
+    AN(update.body);
+    update.body[0] = '\0';
+
+    char *contents = NULL;
+    if (VRB_Iterate(
+            ctx->req->wrk, ctx->vsl, ctx->req,
+            update_remote_body, &update) >= 0) {
+        contents = update.body;
+    } else {
+        LOG(ctx, LOG_ERR,
+            "Failed to read request body (location=%s)",
+            remote->location.raw);
+        free((void *) update.body);
+    }
+
+    unsigned result = end_reload(ctx, &reload, contents);
+
+    if (result) {
+        LOG(ctx, LOG_INFO,
+            "Pushed contents accepted (location=%s, size=%zu)",
+            remote->location.raw, update.bodylen);
+    } else {
+        LOG(ctx, LOG_ERR,
+            "Pushed contents rejected (location=%s, size=%zu)",
+            remote->location.raw, update.bodylen);
+    }
+
+    return result;
+}
+
+unsigned
+warm_start_remote(VRT_CTX, remote_t *remote)
+{
+    unsigned result = 0;
+
+    // Only local I/O here. The remote is fetched by the refresher thread as
+    // soon as the VCL becomes warm.
+    if (remote->backup != NULL) {
+        lock_remote(remote, 1);
+        struct stat st;
+        if ((stat(remote->backup, &st) == 0) && (st.st_size > 0)) {
+            result = check_remote_backup(ctx, remote);
+        }
+        if (result) {
+            set_remote_tst(remote);
+        }
+        unlock_remote(remote, 1);
+    }
+
+    if (result) {
+        AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+        remote->refresher.dirty = 1;
+        AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+    }
+
+    return result;
+}
+
+static void *
+remote_loader(void *ptr)
+{
+    remote_t *remote;
+    CAST_OBJ_NOTNULL(remote, ptr, REMOTE_MAGIC);
+
+    struct vrt_ctx ctx;
+    INIT_OBJ(&ctx, VRT_CTX_MAGIC);
+    AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    ctx.vcl = get_remote_vcl(remote);
+    AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+    reload_remote(&ctx, remote, 0, 0);
+
+    return NULL;
+}
+
+// Starts the initial load of the remote in the background, so all objects
+// in a VCL are loaded concurrently. The first use of the remote (see
+// check_remote()) or the VCL becoming warm (see warm_remotes()) waits for it.
+void
+load_remote(VRT_CTX, remote_t *remote)
+{
+    AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    assert(remote->loader.status == REMOTE_LOADER_IDLE);
+    __atomic_store_n(&remote->loader.status, REMOTE_LOADER_RUNNING, __ATOMIC_RELEASE);
+    AZ(pthread_create(&remote->loader.thread, NULL, &remote_loader, remote));
+    AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+}
+
+static void
+join_loader(remote_t *remote)
+{
+    // Fast path used on every lookup once the initial load is completed.
+    // Everything done by the loader is visible after acquiring the status.
+    if (__atomic_load_n(&remote->loader.status, __ATOMIC_ACQUIRE) == REMOTE_LOADER_IDLE) {
+        return;
+    }
+
+    AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    if (remote->loader.status == REMOTE_LOADER_RUNNING) {
+        __atomic_store_n(&remote->loader.status, REMOTE_LOADER_JOINING, __ATOMIC_RELEASE);
+        AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+        AZ(pthread_join(remote->loader.thread, NULL));
+        AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+        __atomic_store_n(&remote->loader.status, REMOTE_LOADER_IDLE, __ATOMIC_RELEASE);
+        AZ(pthread_cond_broadcast(&vmod_state.remotes.cond));
+    } else {
+        while (remote->loader.status != REMOTE_LOADER_IDLE) {
+            AZ(pthread_cond_wait(&vmod_state.remotes.cond, &vmod_state.remotes.mutex));
+        }
+    }
+    AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+}
+
+/******************************************************************************
+ * INSPECT.
+ *****************************************************************************/
+
+// Writes the raw installed contents to the synthetic response. If they are
+// not kept, the backup file is used instead, as long as automated backups
+// are enabled (i.e. it matches the installed contents). Returns 0 if nothing
+// was written, so callers may reconstruct contents in some other way.
+unsigned
+inspect_remote(VRT_CTX, remote_t *remote)
+{
+    unsigned result = 0;
+
+    if ((ctx->method == VCL_MET_SYNTH) ||
+        (ctx->method == VCL_MET_BACKEND_ERROR)) {
+        struct vsb *vsb = NULL;
+        CAST_OBJ_NOTNULL(vsb, ctx->specific, VSB_MAGIC);
+
+        AZ(pthread_mutex_lock(&remote->state.mutex));
+        if (remote->state.contents != NULL) {
+            AZ(VSB_cat(vsb, remote->state.contents));
+            result = 1;
+        }
+        AZ(pthread_mutex_unlock(&remote->state.mutex));
+        time_t tst = get_remote_tst(remote);
+
+        if (!result &&
+            !remote->keep_contents &&
+            (remote->backup != NULL) &&
+            remote->automated_backups &&
+            (tst > 0)) {
+            flush_backup(ctx, remote);
+            char *contents = read_backup(ctx, remote, NULL);
+            if (contents != NULL) {
+                AZ(VSB_cat(vsb, contents));
+                free((void *) contents);
+                result = 1;
+            }
+        }
+    }
+
+    return result;
+}
+
+/******************************************************************************
+ * COUNTERS.
+ *****************************************************************************/
+
+unsigned
+get_remote_counter(remote_t *remote, const char *name, uint64_t *value)
+{
+    if (strcmp(name, "remote.fetches.modified") == 0) {
+        *value = GET_REMOTE_COUNTER(remote, fetches.modified);
+    } else if (strcmp(name, "remote.fetches.unmodified") == 0) {
+        *value = GET_REMOTE_COUNTER(remote, fetches.unmodified);
+    } else if (strcmp(name, "remote.fetches.failed") == 0) {
+        *value = GET_REMOTE_COUNTER(remote, fetches.failed);
+    } else if (strcmp(name, "remote.fetches.patched") == 0) {
+        *value = GET_REMOTE_COUNTER(remote, fetches.patched);
+    } else if (strcmp(name, "remote.fetches.diverged") == 0) {
+        *value = GET_REMOTE_COUNTER(remote, fetches.diverged);
+    } else if (strcmp(name, "remote.fetches.hedged") == 0) {
+        *value = GET_REMOTE_COUNTER(remote, fetches.hedged);
+    } else if (strcmp(name, "remote.updates.accepted") == 0) {
+        *value = GET_REMOTE_COUNTER(remote, updates.accepted);
+    } else if (strcmp(name, "remote.updates.rejected") == 0) {
+        *value = GET_REMOTE_COUNTER(remote, updates.rejected);
+    } else if (strncmp(name, "remote.backups.", 15) == 0) {
+        AZ(pthread_mutex_lock(&vmod_state.backups.mutex));
+        unsigned found = 1;
+        if (strcmp(name + 15, "written") == 0) {
+            *value = remote->backups.stats.written;
+        } else if (strcmp(name + 15, "failed") == 0) {
+            *value = remote->backups.stats.failed;
+        } else if (strcmp(name + 15, "coalesced") == 0) {
+            *value = remote->backups.stats.coalesced;
+        } else {
+            found = 0;
+        }
+        AZ(pthread_mutex_unlock(&vmod_state.backups.mutex));
+        return found;
+    } else if (strcmp(name, "remote.transfers.bytes") == 0) {
+        *value = GET_REMOTE_COUNTER(remote, transfers.bytes);
+    } else if (strcmp(name, "remote.transfers.decoded_bytes") == 0) {
+        *value = GET_REMOTE_COUNTER(remote, transfers.decoded_bytes);
+    } else if (strcmp(name, "snapshots.retired") == 0) {
+        *value = count_retired_epochs();
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/******************************************************************************
+ * BACKUPS.
+ *****************************************************************************/
+
+static void
+log_backup_error(VRT_CTX, remote_t *remote, const char *tmp, int error)
+{
+    // Not possible to use GNU strerror_r() due to Linux Alpine
+    // issue. See:
+    //   - https://stackoverflow.com/questions/41953104/strerror-r-is-incorrectly-declared-on-alpine-linux
+    char buffer[256];
+#ifdef STRERROR_R_CHAR_P
+    LOG(ctx, LOG_ERR,
+        "Failed to write backup file (location=%s, backup=%s, tmp=%s, error=%s)",
+        remote->location.raw, remote->backup, tmp,
+        strerror_r(error, buffer, sizeof(buffer)));
+#else
+    int rc = strerror_r(error, buffer, sizeof(buffer));
+    if (rc == 0) {
+        LOG(ctx, LOG_ERR,
+            "Failed to write backup file (location=%s, backup=%s, tmp=%s, error=%s)",
+            remote->location.raw, remote->backup, tmp, buffer);
+    } else {
+        LOG(ctx, LOG_ERR,
+            "Failed to write backup file (location=%s, backup=%s, tmp=%s, error=%d)",
+            remote->location.raw, remote->backup, tmp, error);
+    }
+#endif
+}
+
+// Atomically replaces the backup file: contents are written to a temporary
+// file in the same directory, flushed to disk and then renamed.
+static unsigned
+write_backup(VRT_CTX, remote_t *remote, const char *contents)
+{
+    AN(remote->backup);
+
+    char *tmp;
+    assert(asprintf(&tmp, "%s.XXXXXX", remote->backup) > 0);
+
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        LOG(ctx, LOG_ERR,
+            "Failed to open backup file (location=%s, backup=%s, tmp=%s)",
+            remote->location.raw, remote->backup, tmp);
+        free((void *) tmp);
+        return 0;
+    }
+
+    int error = 0;
+    size_t len = strlen(contents);
+    while ((len > 0) && !error) {
+        ssize_t rc = write(fd, contents, len);
+        if (rc > 0) {
+            contents += rc;
+            len -= rc;
+        } else if ((rc < 0) && (errno != EINTR)) {
+            error = errno;
+        }
+    }
+    // mkstemp() creates files only readable by the owner.
+    if (!error && (fchmod(fd, 0644) < 0)) {
+        error = errno;
+    }
+    if (!error && (fsync(fd) < 0)) {
+        error = errno;
+    }
+    if ((close(fd) < 0) && !error) {
+        error = errno;
+    }
+    if (!error && (rename(tmp, remote->backup) < 0)) {
+        error = errno;
+    }
+
+    if (error) {
+        log_backup_error(ctx, remote, tmp, error);
+        unlink(tmp);
+    } else {
+        // Persist the rename. Failures here are not relevant enough.
+        char *dir = strdup(remote->backup);
+        AN(dir);
+        int dfd = open(dirname(dir), O_RDONLY);
+        if (dfd >= 0) {
+            (void) fsync(dfd);
+            close(dfd);
+        }
+        free((void *) dir);
+
+        LOG(ctx, LOG_INFO,
+            "Successfully write to backup file (location=%s, backup=%s)",
+            remote->location.raw, remote->backup);
+    }
+
+    free((void *) tmp);
+    return !error;
+}
+
+// Must be called while holding 'vmod_state.backups.mutex'. The lock is
+// released while writing.
+static void
+run_backup(VRT_CTX, remote_t *remote)
+{
+    assert(remote->backups.queued);
+    AZ(remote->backups.busy);
+    VTAILQ_REMOVE(&vmod_state.backups.queue, remote, backups.list);
+    remote->backups.queued = 0;
+    char *contents = remote->backups.pending;
+    remote->backups.pending = NULL;
+    AN(contents);
+    remote->backups.busy = 1;
+    AZ(pthread_mutex_unlock(&vmod_state.backups.mutex));
+
+    unsigned written = write_backup(ctx, remote, contents);
+    free((void *) contents);
+
+    AZ(pthread_mutex_lock(&vmod_state.backups.mutex));
+    remote->backups.busy = 0;
+    if (written) {
+        remote->backups.stats.written++;
+    } else {
+        remote->backups.stats.failed++;
+    }
+    AZ(pthread_cond_broadcast(&vmod_state.backups.cond));
+}
+
+static void
+queue_backup(VRT_CTX, remote_t *remote, const char *contents)
+{
+    char *copy = strdup(contents);
+    AN(copy);
+
+    AZ(pthread_mutex_lock(&vmod_state.backups.mutex));
+    if (remote->backups.pending != NULL) {
+        free((void *) remote->backups.pending);
+        remote->backups.stats.coalesced++;
+    }
+    remote->backups.pending = copy;
+    if (!remote->backups.queued) {
+        VTAILQ_INSERT_TAIL(&vmod_state.backups.queue, remote, backups.list);
+        remote->backups.queued = 1;
+    }
+    if (vmod_state.backups.running) {
+        AZ(pthread_cond_broadcast(&vmod_state.backups.cond));
+    } else {
+        run_backup(ctx, remote);
+    }
+    AZ(pthread_mutex_unlock(&vmod_state.backups.mutex));
+}
+
+// Waits for pending & in-progress backups of the remote.
+static void
+flush_backup(VRT_CTX, remote_t *remote)
+{
+    AZ(pthread_mutex_lock(&vmod_state.backups.mutex));
+    while (remote->backups.queued || remote->backups.busy) {
+        if (!vmod_state.backups.running && !remote->backups.busy) {
+            run_backup(ctx, remote);
+        } else {
+            AZ(pthread_cond_wait(&vmod_state.backups.cond, &vmod_state.backups.mutex));
+        }
+    }
+    AZ(pthread_mutex_unlock(&vmod_state.backups.mutex));
+}
+
+static void *
+backups_writer(void *unused)
+{
+    struct vrt_ctx ctx;
+    INIT_OBJ(&ctx, VRT_CTX_MAGIC);
+
+    AZ(pthread_mutex_lock(&vmod_state.backups.mutex));
+    while (vmod_state.backups.running ||
+           !VTAILQ_EMPTY(&vmod_state.backups.queue)) {
+        remote_t *remote = VTAILQ_FIRST(&vmod_state.backups.queue);
+        if (remote != NULL) {
+            CHECK_OBJ_NOTNULL(remote, REMOTE_MAGIC);
+            run_backup(&ctx, remote);
+        } else {
+            AZ(pthread_cond_wait(&vmod_state.backups.cond, &vmod_state.backups.mutex));
+        }
+    }
+    AZ(pthread_mutex_unlock(&vmod_state.backups.mutex));
+
+    return NULL;
+}
+
+void
+init_remotes(VRT_CTX)
+{
+    AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    uint64_t seed = (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 24);
+    jitter_seed[0] = seed & 0xffff;
+    jitter_seed[1] = (seed >> 16) & 0xffff;
+    jitter_seed[2] = (seed >> 32) & 0xffff;
+    AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+
+    AZ(pthread_mutex_lock(&vmod_state.backups.mutex));
+    AZ(vmod_state.backups.running);
+    vmod_state.backups.running = 1;
+    AZ(pthread_create(
+        &vmod_state.backups.thread, NULL, &backups_writer, NULL));
+    AZ(pthread_mutex_unlock(&vmod_state.backups.mutex));
+}
+
+void
+fini_remotes(VRT_CTX)
+{
+    AZ(pthread_mutex_lock(&vmod_state.backups.mutex));
+    assert(vmod_state.backups.running);
+    vmod_state.backups.running = 0;
+    AZ(pthread_cond_broadcast(&vmod_state.backups.cond));
+    AZ(pthread_mutex_unlock(&vmod_state.backups.mutex));
+    AZ(pthread_join(vmod_state.backups.thread, NULL));
+}
+
+/******************************************************************************
+ * SCHEDULER.
+ *****************************************************************************/
+
+// Maximum number of concurrent HTTP transfers executed by the scheduler.
+// Long polls are not included. See '--with-max-transfers'.
+#ifndef SCHEDULER_MAX_TRANSFERS
+#define SCHEDULER_MAX_TRANSFERS 8
+#endif
+
+// Reload periods of failing remotes are doubled up to 2^SCHEDULER_MAX_BACKOFF
+// times.
+#define SCHEDULER_MAX_BACKOFF 4
+
+// Reloads executed by the scheduler.
+struct remote_transfer {
+    unsigned magic;
+    #define REMOTE_TRANSFER_MAGIC 0x3c1e5a02
+
+    struct vrt_ctx ctx;
+    struct remote_reload reload;
+    struct read_mirrors_ctx *mirrors;
+    // Set for long polls, which may be held by the server for a long time.
+    unsigned watch;
+    // Start time (see get_mirrors_time()).
+    uint64_t started;
+    // Fetched contents of HTTP transfers, until completed by the worker.
+    char *contents;
+
+    VTAILQ_ENTRY(remote_transfer) list;
+};
+
+VTAILQ_HEAD(remote_transfers, remote_transfer);
+
+// Random +/-10% deviation spreading reloads of remotes sharing the same
+// period (e.g. all objects loaded in the same 'vcl_init'). Must be called
+// while holding 'vmod_state.remotes.mutex'.
+static long
+get_jitter(unsigned delay)
+{
+    return (nrand48(jitter_seed) % (delay / 5 + 1)) - (long) (delay / 10);
+}
+
+static unsigned
+is_long_polling_remote(remote_t *remote)
+{
+    return (remote->curl.watch_timeout > 0) && (remote->read == &read_url);
+}
+
+// Must be called while holding 'vmod_state.remotes.mutex'.
+// Long polls completed early (i.e. well before 'curl.watch_timeout') with no
+// new contents come from servers ignoring 'Prefer: wait' and answering at
+// once. In that case the next long poll is delayed as any periodical reload,
+// instead of polling the server in a tight loop.
+static void
+schedule_remote(remote_t *remote, unsigned failed, unsigned early, time_t now)
+{
+    if (failed) {
+        if (remote->refresher.failures < SCHEDULER_MAX_BACKOFF) {
+            remote->refresher.failures++;
+        }
+    } else {
+        remote->refresher.failures = 0;
+    }
+
+    if (is_long_polling_remote(remote) && !failed && !early) {
+        // The next long poll starts as soon as the previous one completes.
+        remote->refresher.next = now;
+    } else {
+        unsigned delay = remote->period << remote->refresher.failures;
+        remote->refresher.next = now + delay + get_jitter(delay);
+    }
+}
+
+static unsigned
+is_due_remote(remote_t *remote, time_t now)
+{
+    return
+        remote->refresher.warm &&
+        !remote->refresher.busy &&
+        !remote->refresher.reloading &&
+        !remote->refresher.blocked &&
+        (remote->refresher.dirty ||
+         ((remote->period > 0) &&
+          (now >= remote->refresher.next)));
+}
+
+// Must be called while holding 'vmod_state.remotes.mutex'.
+static remote_t *
+get_due_remote(time_t now)
+{
+    remote_t *remote;
+    VTAILQ_FOREACH(remote, &vmod_state.remotes.list, refresher.list) {
+        CHECK_OBJ_NOTNULL(remote, REMOTE_MAGIC);
+        if (is_due_remote(remote, now)) {
+            // Move the remote to the tail of the list in order to avoid
+            // starvation of other remotes.
+            VTAILQ_REMOVE(&vmod_state.remotes.list, remote, refresher.list);
+            VTAILQ_INSERT_TAIL(&vmod_state.remotes.list, remote, refresher.list);
+            remote->refresher.busy = 1;
+            remote->refresher.reloading = 1;
+            remote->refresher.dirty = 0;
+            return remote;
+        }
+    }
+    return NULL;
+}
+
+// Long polls are cancelled when they are no longer needed or when they are
+// getting in the way of other threads. Must be called while holding
+// 'vmod_state.remotes.mutex'.
+static unsigned
+is_cancelled_transfer(struct remote_transfer *transfer)
+{
+    remote_t *remote = transfer->reload.remote;
+    return
+        transfer->watch &&
+        (!vmod_state.remotes.running ||
+         !remote->refresher.warm ||
+         remote->refresher.blocked);
+}
+
+static void
+complete_transfer(struct remote_transfer *transfer, char *contents)
+{
+    remote_t *remote = transfer->reload.remote;
+
+    end_reload(&transfer->ctx, &transfer->reload, contents);
+
+    unsigned early =
+        transfer->watch &&
+        transfer->reload.unmodified &&
+        (get_mirrors_time() - transfer->started < remote->curl.watch_timeout / 2);
+
+    AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    remote->refresher.busy = 0;
+    schedule_remote(remote, transfer->reload.failed, early, time(NULL));
+    AZ(pthread_cond_broadcast(&vmod_state.remotes.cond));
+    AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+
+    FREE_OBJ(transfer);
+}
+
+// Hands the transfer over to the worker, which completes it.
+static void
+queue_transfer(struct remote_transfer *transfer)
+{
+    AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    VTAILQ_INSERT_TAIL(&vmod_state.remotes.worker.queue, transfer, list);
+    AZ(pthread_cond_signal(&vmod_state.remotes.worker.cond));
+    AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+}
+
+// Starts a reload of the remote. HTTP transfers are added to the multi handle.
+// Any other reload is handed over to the worker, and NULL is returned.
+static struct remote_transfer *
+start_transfer(CURLM *multi, remote_t *remote, struct vcl *vcl)
+{
+    struct remote_transfer *transfer;
+    ALLOC_OBJ(transfer, REMOTE_TRANSFER_MAGIC);
+    AN(transfer);
+    INIT_OBJ(&transfer->ctx, VRT_CTX_MAGIC);
+    transfer->ctx.vcl = vcl;
+
+    begin_reload(&transfer->reload, remote, 0, 1, 0);
+
+    transfer->started = get_mirrors_time();
+    transfer->contents = NULL;
+
+    if (remote->read == &read_url) {
+        transfer->watch = is_long_polling_remote(remote);
+        transfer->mirrors = start_mirrors(
+            &transfer->ctx, remote, multi, transfer, 1, transfer->watch,
+            transfer->reload.feed);
+        return transfer;
+    } else {
+        transfer->watch = 0;
+        transfer->mirrors = NULL;
+        queue_transfer(transfer);
+        return NULL;
+    }
+}
+
+static void
+finish_transfer(struct remote_transfer *transfer)
+{
+    transfer->contents = finish_mirrors(
+        transfer->mirrors, &transfer->reload.unmodified);
+    transfer->mirrors = NULL;
+    queue_transfer(transfer);
+}
+
+// Completes reloads handed over by the scheduler, reading local files first
+// if needed. Parsing & installing large documents may take a while, and
+// that must not delay transfers of other remotes in the multi handle.
+static void *
+remotes_worker(void *unused)
+{
+    struct remote_transfer *transfer;
+
+    AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    while (vmod_state.remotes.worker.running ||
+           !VTAILQ_EMPTY(&vmod_state.remotes.worker.queue)) {
+        transfer = VTAILQ_FIRST(&vmod_state.remotes.worker.queue);
+        if (transfer == NULL) {
+            AZ(pthread_cond_wait(
+                &vmod_state.remotes.worker.cond, &vmod_state.remotes.mutex));
+            continue;
+        }
+        CHECK_OBJ_NOTNULL(transfer, REMOTE_TRANSFER_MAGIC);
+        VTAILQ_REMOVE(&vmod_state.remotes.worker.queue, transfer, list);
+        AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+
+        remote_t *remote = transfer->reload.remote;
+        if (remote->read != &read_url) {
+            AZ(transfer->contents);
+            transfer->contents = (*remote->read)(
+                &transfer->ctx, remote, 1, &transfer->reload.unmodified,
+                transfer->reload.feed);
+        }
+        complete_transfer(transfer, transfer->contents);
+
+        AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    }
+    AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+
+    return NULL;
+}
+
+static void
+cancel_transfer(struct remote_transfer *transfer)
+{
+    remote_t *remote = transfer->reload.remote;
+
+    unsigned unmodified;
+    AZ(finish_mirrors(transfer->mirrors, &unmodified));
+    transfer->mirrors = NULL;
+    cancel_reload(&transfer->ctx, &transfer->reload);
+
+    AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    remote->refresher.busy = 0;
+    remote->refresher.next = time(NULL);
+    AZ(pthread_cond_broadcast(&vmod_state.remotes.cond));
+    AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+
+    LOG(&transfer->ctx, LOG_INFO,
+        "Long poll cancelled (location=%s)",
+        remote->location.raw);
+
+    FREE_OBJ(transfer);
+}
+
+// VMOD-wide scheduler of periodical reloads. HTTP transfers of all due
+// remotes are concurrently executed using a single multi handle. Reloads
+// are then completed by the worker (see remotes_worker()).
+static void *
+remotes_scheduler(void *unused)
+{
+    CURLM *multi = curl_multi_init();
+    AN(multi);
+    struct remote_transfers transfers = VTAILQ_HEAD_INITIALIZER(transfers);
+    struct remote_transfer *transfer, *transfer_tmp;
+    unsigned ntransfers = 0;
+    unsigned nwatches = 0;
+
+    AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    vmod_state.remotes.multi = multi;
+    AZ(vmod_state.remotes.worker.running);
+    vmod_state.remotes.worker.running = 1;
+    AZ(pthread_create(
+        &vmod_state.remotes.worker.thread, NULL, &remotes_worker, NULL));
+    while (vmod_state.remotes.running || (ntransfers > 0)) {
+        remote_t *remote;
+        while (vmod_state.remotes.running &&
+               (ntransfers - nwatches < SCHEDULER_MAX_TRANSFERS) &&
+               ((remote = get_due_remote(time(NULL))) != NULL)) {
+            struct vcl *vcl = get_remote_vcl(remote);
+            AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+            transfer = start_transfer(multi, remote, vcl);
+            if (transfer != NULL) {
+                VTAILQ_INSERT_TAIL(&transfers, transfer, list);
+                ntransfers++;
+                nwatches += transfer->watch;
+            }
+            AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+        }
+
+        VTAILQ_FOREACH_SAFE(transfer, &transfers, list, transfer_tmp) {
+            if (is_cancelled_transfer(transfer)) {
+                VTAILQ_REMOVE(&transfers, transfer, list);
+                ntransfers--;
+                nwatches--;
+                AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+                cancel_transfer(transfer);
+                AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+            }
+        }
+
+        if (ntransfers > 0) {
+            AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+
+            // Hedged requests to mirrors of slow transfers.
+            long timeout = 1000;
+            VTAILQ_FOREACH(transfer, &transfers, list) {
+                long delay = poll_mirrors(transfer->mirrors);
+                if ((delay >= 0) && (delay < timeout)) {
+                    timeout = delay;
+                }
+            }
+
+            int running, pending;
+            curl_multi_perform(multi, &running);
+            CURLMsg *msg;
+            while ((msg = curl_multi_info_read(multi, &pending)) != NULL) {
+                if (msg->msg == CURLMSG_DONE) {
+                    char *ptr;
+                    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &ptr);
+                    CAST_OBJ_NOTNULL(transfer, (void *) ptr, REMOTE_TRANSFER_MAGIC);
+                    complete_mirror(
+                        transfer->mirrors, msg->easy_handle, msg->data.result);
+                    if (is_done_mirrors(transfer->mirrors)) {
+                        VTAILQ_REMOVE(&transfers, transfer, list);
+                        ntransfers--;
+                        nwatches -= transfer->watch;
+                        finish_transfer(transfer);
+                    }
+                }
+            }
+            if (ntransfers > 0) {
+                curl_multi_wait(multi, NULL, 0, timeout, NULL);
+            }
+
+            AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+        } else if (vmod_state.remotes.running) {
+            struct timespec deadline;
+            AZ(clock_gettime(CLOCK_REALTIME, &deadline));
+            deadline.tv_sec += 1;
+            int rc = pthread_cond_timedwait(
+                &vmod_state.remotes.cond, &vmod_state.remotes.mutex,
+                &deadline);
+            assert(rc == 0 || rc == ETIMEDOUT);
+        }
+
+        // Snapshots retired while readers were still using them are
+        // released here if no other one is published in the meantime.
+        AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+        collect_epochs();
+        AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    }
+    vmod_state.remotes.multi = NULL;
+
+    // Pending reloads are completed before the worker exits.
+    vmod_state.remotes.worker.running = 0;
+    AZ(pthread_cond_signal(&vmod_state.remotes.worker.cond));
+    AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+    AZ(pthread_join(vmod_state.remotes.worker.thread, NULL));
+
+    curl_multi_cleanup(multi);
+
+    return NULL;
+}
+
+// Interrupts the scheduler while waiting for transfers, so cancelled long
+// polls are noticed immediately (otherwise, it takes up to 1 second). Must
+// be called while holding 'vmod_state.remotes.mutex'.
+static void
+wakeup_scheduler()
+{
+#if LIBCURL_VERSION_NUM >= 0x074400
+    if (vmod_state.remotes.multi != NULL) {
+        curl_multi_wakeup(vmod_state.remotes.multi);
+    }
+#endif
+    AZ(pthread_cond_broadcast(&vmod_state.remotes.cond));
+}
+
+// Must be called while holding 'vmod_state.remotes.mutex'.
+static void
+block_remote(remote_t *remote)
+{
+    remote->refresher.blocked++;
+    wakeup_scheduler();
+}
+
+// Must be called while holding 'vmod_state.remotes.mutex'.
+static void
+unblock_remote(remote_t *remote)
+{
+    assert(remote->refresher.blocked > 0);
+    remote->refresher.blocked--;
+}
+
+// Serializes reloads of the remote. Background reloads are started by the
+// scheduler and completed by the worker, so a flag is used instead of a
+// mutex. They own the remote as soon as it is picked by the scheduler (see
+// get_due_remote()), so the scheduler never waits here. Foreground reloads
+// cancel in-progress long polls instead of waiting for them, and keep the
+// scheduler away from the remote until they are completed.
+static void
+lock_remote(remote_t *remote, unsigned foreground)
+{
+    AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    if (foreground) {
+        block_remote(remote);
+        while (remote->refresher.reloading) {
+            AZ(pthread_cond_wait(&vmod_state.remotes.cond, &vmod_state.remotes.mutex));
+        }
+        remote->refresher.reloading = 1;
+    } else {
+        AN(remote->refresher.busy);
+        AN(remote->refresher.reloading);
+    }
+    AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+}
+
+static void
+unlock_remote(remote_t *remote, unsigned foreground)
+{
+    AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    AN(remote->refresher.reloading);
+    remote->refresher.reloading = 0;
+    if (foreground) {
+        unblock_remote(remote);
+    }
+    AZ(pthread_cond_broadcast(&vmod_state.remotes.cond));
+    AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+// Local files are usually replaced using atomic renames, so the parent
+// directory is watched instead of the file itself. The directory of the
+// backup file is not watched: backups are written by the VMOD itself, and
+// they are only read when 'location' can't be loaded.
+#define WATCHER_MASK (IN_CLOSE_WRITE | IN_MOVED_TO)
+
+static void
+watch_remote(remote_t *remote)
+{
+    if ((vmod_state.remotes.watcher.fd >= 0) &&
+        ((remote->read == &read_path) || (remote->read == &read_glob)) &&
+        (remote->period > 0)) {
+        char *path = strdup(remote->location.parsed);
+        AN(path);
+        remote->refresher.wd = inotify_add_watch(
+            vmod_state.remotes.watcher.fd, dirname(path), WATCHER_MASK);
+        free((void *) path);
+    }
+}
+
+// Removes the watch of the directory of the local file, unless some other
+// remote lives in the same directory (the kernel returns the same watch
+// descriptor for all of them). Must be called while holding
+// 'vmod_state.remotes.mutex'.
+static void
+unwatch_remote(remote_t *remote)
+{
+    if ((vmod_state.remotes.watcher.fd >= 0) && (remote->refresher.wd >= 0)) {
+        remote_t *iremote;
+        VTAILQ_FOREACH(iremote, &vmod_state.remotes.list, refresher.list) {
+            CHECK_OBJ_NOTNULL(iremote, REMOTE_MAGIC);
+            if ((iremote != remote) &&
+                (iremote->refresher.wd == remote->refresher.wd)) {
+                break;
+            }
+        }
+        if (iremote == NULL) {
+            // Fails if the directory was already removed.
+            (void) inotify_rm_watch(
+                vmod_state.remotes.watcher.fd, remote->refresher.wd);
+        }
+    }
+    remote->refresher.wd = -1;
+}
+
+static unsigned
+is_watched_remote(remote_t *remote, const struct inotify_event *event)
+{
+    if ((event->mask & IN_Q_OVERFLOW) && (remote->refresher.wd >= 0)) {
+        return 1;
+    } else if ((event->wd == remote->refresher.wd) && (event->len > 0)) {
+        const char *name = strrchr(remote->location.parsed, '/');
+        name = (name != NULL) ? name + 1 : remote->location.parsed;
+        if (remote->read == &read_glob) {
+            return fnmatch(name, event->name, FNM_PERIOD) == 0;
+        }
+        return strcmp(event->name, name) == 0;
+    }
+    return 0;
+}
+
+static void *
+remotes_watcher(void *unused)
+{
+    char buffer[16 * 1024]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    struct pollfd fds[2] = {
+        { .fd = vmod_state.remotes.watcher.fd, .events = POLLIN },
+        { .fd = vmod_state.remotes.watcher.pipe[0], .events = POLLIN }
+    };
+
+    while (1) {
+        int rc = poll(fds, 2, -1);
+        if (rc < 0) {
+            assert(errno == EINTR);
+            continue;
+        }
+
+        // Any activity in the pipe means the watcher should stop.
+        if (fds[1].revents != 0) {
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            ssize_t len = read(fds[0].fd, buffer, sizeof(buffer));
+            if (len <= 0) {
+                continue;
+            }
+
+            unsigned dirty = 0;
+            AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+            const struct inotify_event *event;
+            for (char *ptr = buffer; ptr < buffer + len; ptr += sizeof(struct inotify_event) + event->len) {
+                event = (const struct inotify_event *) ptr;
+                remote_t *iremote;
+                VTAILQ_FOREACH(iremote, &vmod_state.remotes.list, refresher.list) {
+                    CHECK_OBJ_NOTNULL(iremote, REMOTE_MAGIC);
+                    if (is_watched_remote(iremote, event)) {
+                        iremote->refresher.dirty = 1;
+                        dirty = 1;
+                    }
+                }
+            }
+            if (dirty) {
+                AZ(pthread_cond_broadcast(&vmod_state.remotes.cond));
+            }
+            AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+        }
+    }
+
+    return NULL;
+}
+
+static void
+start_watcher()
+{
+    assert(vmod_state.remotes.watcher.fd < 0);
+    vmod_state.remotes.watcher.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (vmod_state.remotes.watcher.fd >= 0) {
+        AZ(pipe(vmod_state.remotes.watcher.pipe));
+        AZ(pthread_create(
+            &vmod_state.remotes.watcher.thread, NULL, &remotes_watcher, NULL));
+    }
+}
+
+static void
+stop_watcher()
+{
+    if (vmod_state.remotes.watcher.fd >= 0) {
+        assert(write(vmod_state.remotes.watcher.pipe[1], "", 1) == 1);
+        AZ(pthread_join(vmod_state.remotes.watcher.thread, NULL));
+        AZ(close(vmod_state.remotes.watcher.pipe[0]));
+        AZ(close(vmod_state.remotes.watcher.pipe[1]));
+        vmod_state.remotes.watcher.pipe[0] = -1;
+        vmod_state.remotes.watcher.pipe[1] = -1;
+        // Closing the inotify instance releases all watches.
+        AZ(close(vmod_state.remotes.watcher.fd));
+        vmod_state.remotes.watcher.fd = -1;
+
+        remote_t *iremote;
+        AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+        VTAILQ_FOREACH(iremote, &vmod_state.remotes.list, refresher.list) {
+            iremote->refresher.wd = -1;
+        }
+        AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+    }
+}
+
+#undef WATCHER_MASK
+
+#else
+
+static void
+watch_remote(remote_t *remote)
+{
+}
+
+static void
+unwatch_remote(remote_t *remote)
+{
+}
+
+static void
+start_watcher()
+{
+}
+
+static void
+stop_watcher()
+{
+}
+
+#endif
+
+void
+warm_remotes(VRT_CTX)
+{
+    remote_t *iremote;
+
+    // Initial loads of the VCL must be completed before it becomes warm.
+    AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+    do {
+        VTAILQ_FOREACH(iremote, &vmod_state.remotes.list, refresher.list) {
+            CHECK_OBJ_NOTNULL(iremote, REMOTE_MAGIC);
+            if ((iremote->loader.status != REMOTE_LOADER_IDLE) &&
+                (find_remote_user(iremote, ctx->vcl) != NULL)) {
+                break;
+            }
+        }
+        if (iremote != NULL) {
+            AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+            join_loader(iremote);
+            AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+        }
+    } while (iremote != NULL);
+
+    if (vmod_state.remotes.warm++ == 0) {
+        AZ(vmod_state.remotes.running);
+        vmod_state.remotes.running = 1;
+        start_watcher();
+        AZ(pthread_create(
+            &vmod_state.remotes.thread, NULL, &remotes_scheduler, NULL));
+    }
+
+    VTAILQ_FOREACH(iremote, &vmod_state.remotes.list, refresher.list) {
+        CHECK_OBJ_NOTNULL(iremote, REMOTE_MAGIC);
+        remote_user_t *user = find_remote_user(iremote, ctx->vcl);
+        if ((user != NULL) && !user->warm) {
+            user->warm = 1;
+            iremote->refresher.warm++;
+            if (iremote->refresher.next == 0) {
+                time_t tst = get_remote_tst(iremote);
+                if (is_long_polling_remote(iremote)) {
+                    iremote->refresher.next = tst;
+                } else {
+                    iremote->refresher.next =
+                        tst + iremote->period + get_jitter(iremote->period);
+                }
+            }
+            if (iremote->refresher.wd < 0) {
+                watch_remote(iremote);
+            }
+        }
+    }
+
+    AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+}
+
+void
+cool_remotes(VRT_CTX)
+{
+    AZ(pthread_mutex_lock(&vmod_state.remotes.mutex));
+
+    remote_t *iremote;
+    VTAILQ_FOREACH(iremote, &vmod_state.remotes.list, refresher.list) {
+        CHECK_OBJ_NOTNULL(iremote, REMOTE_MAGIC);
+        remote_user_t *user = find_remote_user(iremote, ctx->vcl);
+        if ((user != NULL) && user->warm) {
+            user->warm = 0;
+            assert(iremote->refresher.warm > 0);
+            iremote->refresher.warm--;
+        }
+    }
+
+    // Don't leave the cold VCL while the refresher is still working on any
+    // of its remotes.
+retry:
+    VTAILQ_FOREACH(iremote, &vmod_state.remotes.list, refresher.list) {
+        if (iremote->refresher.busy &&
+            (find_remote_user(iremote, ctx->vcl) != NULL)) {
+            block_remote(iremote);
+            AZ(pthread_cond_wait(&vmod_state.remotes.cond, &vmod_state.remotes.mutex));
+            unblock_remote(iremote);
+            goto retry;
+        }
+    }
+
+    assert(vmod_state.remotes.warm > 0);
+    if (--vmod_state.remotes.warm == 0) {
+        AN(vmod_state.remotes.running);
+        vmod_state.remotes.running = 0;
+        AZ(pthread_cond_broadcast(&vmod_state.remotes.cond));
+        AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+        stop_watcher();
+        AZ(pthread_join(vmod_state.remotes.thread, NULL));
+    } else {
+        AZ(pthread_mutex_unlock(&vmod_state.remotes.mutex));
+    }
+}
+
+/******************************************************************************
+ * HELPERS.
+ *****************************************************************************/
+
+// Must be called while holding 'vmod_state.remotes.mutex'.
+static remote_user_t *
+find_remote_user(remote_t *remote, struct vcl *vcl)
+{
+    remote_user_t *iuser;
+    VTAILQ_FOREACH(iuser, &remote->refresher.users, list) {
+        CHECK_OBJ_NOTNULL(iuser, REMOTE_USER_MAGIC);
+        if (iuser->vcl == vcl) {
+            return iuser;
+        }
+    }
+    return NULL;
+}
+
+// VCL used when reloading the remote in the background: any warm user or,
+// if none, the oldest one. Must be called while holding
+// 'vmod_state.remotes.mutex'.
+static struct vcl *
+get_remote_vcl(remote_t *remote)
+{
+    remote_user_t *iuser;
+    VTAILQ_FOREACH(iuser, &remote->refresher.users, list) {
+        CHECK_OBJ_NOTNULL(iuser, REMOTE_USER_MAGIC);
+        if (iuser->warm) {
+            return iuser->vcl;
+        }
+    }
+    iuser = VTAILQ_FIRST(&remote->refresher.users);
+    return (iuser != NULL) ? iuser->vcl : NULL;
+}
+
+// Size of the chunks read from local files and fed to incremental parsers.
+#define READ_FILE_CHUNK_SIZE (64 * 1024)
+
+static char *
+read_file(
+    VRT_CTX, remote_t *remote, const char *file, struct remote_feed *feed)
+{
+    char *result = NULL;
+
+    FILE *bf = fopen(file, "rb");
+    if (bf != NULL) {
+        fseek(bf, 0, SEEK_END);
+        unsigned long fsize = ftell(bf);
+        fseek(bf, 0, SEEK_SET);
+
+        // Discarded contents are read chunk by chunk into the same buffer,
+        // and an empty string is returned.
+        unsigned discard = is_discarding_feed(feed);
+        size_t size = fsize;
+        if (discard && (size > READ_FILE_CHUNK_SIZE)) {
+            size = READ_FILE_CHUNK_SIZE;
+        }
+        result = malloc(size + 1);
+        AN(result);
+        size_t nitems = 0;
+        while (nitems < fsize) {
+            size_t chunk = fsize - nitems;
+            if (chunk > READ_FILE_CHUNK_SIZE) {
+                chunk = READ_FILE_CHUNK_SIZE;
+            }
+            char *ptr = discard ? result : result + nitems;
+            chunk = fread(ptr, 1, chunk, bf);
+            if (chunk == 0) {
+                break;
+            }
+            feed_remote(ctx, feed, ptr, chunk);
+            nitems += chunk;
+        }
+        fclose(bf);
+        result[discard ? 0 : fsize] = '\0';
+
+        if (nitems != fsize) {
+            free((void *) result);
+            result = NULL;
 
             LOG(ctx, LOG_ERR,
                 "Failed to read file (location=%s, file=%s)",
@@ -344,56 +2328,496 @@ read_file(VRT_CTX, remote_t *remote, const char *file)
 }
 
 static char *
-read_backup(VRT_CTX, remote_t *remote)
+read_backup(VRT_CTX, remote_t *remote, struct remote_feed *feed)
 {
     AN(remote->backup);
-    return read_file(ctx, remote, remote->backup);
+    return read_file(ctx, remote, remote->backup, feed);
+}
+
+static char *
+read_path(
+    VRT_CTX, remote_t *remote, unsigned conditional, unsigned *unmodified,
+    struct remote_feed *feed)
+{
+    *unmodified = 0;
+
+    // Cheap change detection: skip reading the file at all when it looks
+    // exactly like the last loaded one.
+    struct stat st;
+    unsigned stated = stat(remote->location.parsed, &st) == 0;
+    if (conditional &&
+        stated &&
+        remote->state.validators.file.set &&
+        (remote->state.validators.file.dev == st.st_dev) &&
+        (remote->state.validators.file.ino == st.st_ino) &&
+        (remote->state.validators.file.mtim.tv_sec == st.st_mtim.tv_sec) &&
+        (remote->state.validators.file.mtim.tv_nsec == st.st_mtim.tv_nsec) &&
+        (remote->state.validators.file.size == st.st_size)) {
+        *unmodified = 1;
+        return NULL;
+    }
+
+    char *result = read_file(ctx, remote, remote->location.parsed, feed);
+
+    if ((result != NULL) && stated) {
+        remote->state.validators.file.set = 1;
+        remote->state.validators.file.dev = st.st_dev;
+        remote->state.validators.file.ino = st.st_ino;
+        remote->state.validators.file.mtim = st.st_mtim;
+        remote->state.validators.file.size = st.st_size;
+    }
+
+    return result;
+}
+
+static const remote_part_t *
+find_glob_part(remote_t *remote, const char *path)
+{
+    for (unsigned i = 0; i < remote->state.glob.nparts; i++) {
+        if (strcmp(remote->state.glob.parts[i].path, path) == 0) {
+            return &remote->state.glob.parts[i];
+        }
+    }
+    return NULL;
 }
 
+// Glob locations are handled as a set of local files, concatenated in
+// lexical order. All matching files are stat'ed on every reload, but only
+// new or changed ones are actually read. Matching files are kept as pending
+// parts until the end of the reload. See close_glob().
 static char *
-read_path(VRT_CTX, remote_t *remote)
+read_glob(
+    VRT_CTX, remote_t *remote, unsigned conditional, unsigned *unmodified,
+    struct remote_feed *feed)
+{
+    *unmodified = 0;
+    AZ(remote->state.glob.pending);
+
+    glob_t g;
+    int rc = glob(remote->location.parsed, 0, NULL, &g);
+    if (rc != 0) {
+        if (rc == GLOB_NOMATCH) {
+            LOG(ctx, LOG_ERR,
+                "No files matching location (location=%s)",
+                remote->location.raw);
+        } else {
+            LOG(ctx, LOG_ERR,
+                "Failed to expand location (location=%s, error=%d)",
+                remote->location.raw, rc);
+        }
+        globfree(&g);
+        return NULL;
+    }
+
+    remote_part_t *parts = calloc(g.gl_pathc, sizeof(remote_part_t));
+    AN(parts);
+    unsigned nparts = 0;
+    unsigned changed = 0;
+    unsigned failed = 0;
+
+    for (size_t i = 0; (i < g.gl_pathc) && !failed; i++) {
+        const char *path = g.gl_pathv[i];
+
+        // Directories and other special files are ignored.
+        struct stat st;
+        if ((stat(path, &st) != 0) || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        remote_part_t *part = &parts[nparts++];
+        part->path = strdup(path);
+        AN(part->path);
+        part->dev = st.st_dev;
+        part->ino = st.st_ino;
+        part->mtim = st.st_mtim;
+        part->size = st.st_size;
+
+        const remote_part_t *old = find_glob_part(remote, path);
+        if ((old != NULL) &&
+            (old->dev == st.st_dev) &&
+            (old->ino == st.st_ino) &&
+            (old->mtim.tv_sec == st.st_mtim.tv_sec) &&
+            (old->mtim.tv_nsec == st.st_mtim.tv_nsec) &&
+            (old->size == st.st_size)) {
+            part->contents = old->contents;
+            part->changed = 0;
+        } else {
+            part->contents = read_file(ctx, remote, path, NULL);
+            part->changed = 1;
+            changed = 1;
+            failed = part->contents == NULL;
+        }
+    }
+
+    globfree(&g);
+
+    if (!failed && (nparts == 0)) {
+        LOG(ctx, LOG_ERR,
+            "No files matching location (location=%s)",
+            remote->location.raw);
+        failed = 1;
+    }
+
+    // Paths are unique, so same number of files & no changes means exactly
+    // the same set of files.
+    if (nparts != remote->state.glob.nparts) {
+        changed = 1;
+    }
+
+    remote->state.glob.pending = parts;
+    remote->state.glob.npending = nparts;
+
+    if (failed || (conditional && !changed)) {
+        close_glob(remote, 0);
+        *unmodified = !failed;
+        return NULL;
+    }
+
+    struct vsb *vsb = VSB_new_auto();
+    AN(vsb);
+    for (unsigned i = 0; i < nparts; i++) {
+        size_t len = strlen(parts[i].contents);
+        AZ(VSB_bcat(vsb, parts[i].contents, len));
+        if ((len > 0) && (parts[i].contents[len - 1] != '\n')) {
+            AZ(VSB_putc(vsb, '\n'));
+        }
+    }
+    AZ(VSB_finish(vsb));
+    char *result = strdup(VSB_data(vsb));
+    AN(result);
+    VSB_destroy(&vsb);
+
+    // Files parsed one by one don't need the incremental parser.
+    if (remote->parts == NULL) {
+        feed_remote(ctx, feed, result, strlen(result));
+    }
+
+    return result;
+}
+
+// Ends the reload of a glob location: pending parts replace the ones of the
+// last successful load if 'commit' is enabled, or are discarded otherwise.
+// Contents of unchanged parts are shared by both lists.
+static void
+close_glob(remote_t *remote, unsigned commit)
+{
+    remote_part_t *parts = remote->state.glob.pending;
+    unsigned nparts = remote->state.glob.npending;
+
+    if (parts == NULL) {
+        return;
+    }
+
+    if (commit) {
+        for (unsigned i = 0; i < remote->state.glob.nparts; i++) {
+            remote_part_t *old = &remote->state.glob.parts[i];
+            unsigned shared = 0;
+            for (unsigned j = 0; (j < nparts) && !shared; j++) {
+                shared = !parts[j].changed && (parts[j].contents == old->contents);
+            }
+            if (!shared) {
+                free((void *) old->contents);
+            }
+            free((void *) old->path);
+        }
+        free((void *) remote->state.glob.parts);
+        remote->state.glob.parts = parts;
+        remote->state.glob.nparts = nparts;
+    } else {
+        for (unsigned i = 0; i < nparts; i++) {
+            if (parts[i].changed) {
+                free((void *) parts[i].contents);
+            }
+            free((void *) parts[i].path);
+        }
+        free((void *) parts);
+    }
+
+    remote->state.glob.pending = NULL;
+    remote->state.glob.npending = 0;
+}
+
+static void
+digest_contents(const char *contents, unsigned char *digest)
+{
+    struct SHA256Context sha_ctx;
+    SHA256_Init(&sha_ctx);
+    SHA256_Update(&sha_ctx, contents, strlen(contents));
+    SHA256_Final(digest, &sha_ctx);
+}
+
+static void
+set_digest(remote_t *remote, const char *contents)
+{
+    digest_contents(contents, remote->state.digest.value);
+    remote->state.digest.set = 1;
+}
+
+static void
+reset_validators(remote_t *remote)
+{
+    free((void *) remote->state.validators.etag);
+    remote->state.validators.etag = NULL;
+    free((void *) remote->state.validators.last_modified);
+    remote->state.validators.last_modified = NULL;
+    free((void *) remote->state.validators.index);
+    remote->state.validators.index = NULL;
+    remote->state.validators.file.set = 0;
+}
+
+// Process-wide share of DNS cache, connection cache & TLS sessions between
+// the easy handles of all remotes. Lazily created and never released.
+static CURLSH *share = NULL;
+static pthread_once_t share_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t share_mutexes[CURL_LOCK_DATA_LAST];
+
+static void
+lock_share(CURL *ch, curl_lock_data data, curl_lock_access access, void *ptr)
+{
+    AZ(pthread_mutex_lock(&share_mutexes[data]));
+}
+
+static void
+unlock_share(CURL *ch, curl_lock_data data, void *ptr)
+{
+    AZ(pthread_mutex_unlock(&share_mutexes[data]));
+}
+
+static void
+init_share()
+{
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        AZ(pthread_mutex_init(&share_mutexes[i], NULL));
+    }
+    share = curl_share_init();
+    AN(share);
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock_share);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock_share);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+}
+
+static CURLSH *
+get_share()
 {
-    return read_file(ctx, remote, remote->location.parsed);
+    AZ(pthread_once(&share_once, init_share));
+    AN(share);
+    return share;
 }
 
+// Initial size of the body buffer when the response doesn't include a
+// 'Content-Length' header.
+#define READ_URL_BODY_MIN_SIZE (16 * 1024)
+
+// Maximum size of the body buffer allocated in advance because of the
+// 'Content-Length' header. Larger bodies grow geometrically as received, so
+// a bogus announced length can't trigger a huge allocation.
+#define READ_URL_BODY_MAX_PRESIZE (4 * 1024 * 1024)
+
 struct read_url_ctx {
+    const struct vrt_ctx *vrt_ctx;
+    remote_mirror_t *mirror;
+    CURL *ch;
+    // Status code of the response (-1 until the body starts).
+    long status;
+    // Incremental parser fed with the body of 200 responses (or NULL).
+    struct remote_feed *feed;
+    // Set when several mirrors may be concurrently requested. The body is
+    // then fed once the transfer wins (see finish_url()), instead of while
+    // being received.
+    unsigned deferred;
+    // Extra request headers (or NULL).
+    struct curl_slist *headers;
+    // Set when validators were sent (i.e. 'If-None-Match' or
+    // 'If-Modified-Since'), so 304 responses are meaningful.
+    unsigned validated;
     char *body;
     size_t bodylen;
+    // Allocated size of 'body' (always > 'bodylen').
+    size_t bodysize;
+    // Body bytes fed but not added to 'body' (see is_discarding_feed()).
+    size_t discarded;
+    // Maximum allowed 'bodylen' (0 means no limit).
+    size_t max_bodylen;
+    // Set when the transfer was aborted because of 'max_bodylen'.
+    unsigned oversized;
+    const char *etag;
+    const char *last_modified;
+    const char *index;
+    // Type of patch announced by the response (i.e. REMOTE_PATCH_*).
+    unsigned patch;
 };
 
+static void
+reserve_url_body(struct read_url_ctx *ctx, size_t size)
+{
+    if (size > ctx->bodysize) {
+        ctx->body = realloc(ctx->body, size);
+        AN(ctx->body);
+        ctx->bodysize = size;
+    }
+}
+
+static const char *
+read_url_header_value(const char *header, size_t len, const char *name)
+{
+    size_t nlen = strlen(name);
+    if ((len > nlen) &&
+        (strncasecmp(header, name, nlen) == 0) &&
+        (header[nlen] == ':')) {
+        const char *start = header + nlen + 1;
+        const char *end = header + len;
+        for (; (start < end) && isspace(*start); start++);
+        for (; (end > start) && isspace(*(end - 1)); end--);
+        if (end > start) {
+            char *result = strndup(start, end - start);
+            AN(result);
+            return result;
+        }
+    }
+    return NULL;
+}
+
+static size_t
+read_url_header(char *header, size_t size, size_t nitems, void *c)
+{
+    struct read_url_ctx *ctx = (struct read_url_ctx *) c;
+
+    size_t len = size * nitems;
+    const char *value;
+
+    if ((len > 5) && (strncmp(header, "HTTP/", 5) == 0)) {
+        // New response (e.g. after a '100 Continue'): forget previous headers.
+        free((void *) ctx->etag);
+        ctx->etag = NULL;
+        free((void *) ctx->last_modified);
+        ctx->last_modified = NULL;
+        free((void *) ctx->index);
+        ctx->index = NULL;
+        ctx->patch = REMOTE_PATCH_NONE;
+    } else if ((value = read_url_header_value(header, len, "ETag")) != NULL) {
+        free((void *) ctx->etag);
+        ctx->etag = value;
+    } else if ((value = read_url_header_value(header, len, "Last-Modified")) != NULL) {
+        free((void *) ctx->last_modified);
+        ctx->last_modified = value;
+    } else if ((value = read_url_header_value(header, len, "X-Consul-Index")) != NULL) {
+        free((void *) ctx->index);
+        ctx->index = value;
+    } else if (((value = read_url_header_value(header, len, "IM")) != NULL) ||
+               ((value = read_url_header_value(header, len, "Content-Type")) != NULL)) {
+        // Both the instance manipulation (RFC 3229) and the media type of
+        // the patch are accepted.
+        if ((strcasecmp(value, "merge-patch") == 0) ||
+            (strncasecmp(value, "application/merge-patch+json", 28) == 0)) {
+            ctx->patch = REMOTE_PATCH_MERGE;
+        } else if ((strcasecmp(value, "json-patch") == 0) ||
+                   (strncasecmp(value, "application/json-patch+json", 27) == 0)) {
+            ctx->patch = REMOTE_PATCH_JSON;
+        }
+        free((void *) value);
+    } else if ((value = read_url_header_value(header, len, "Content-Length")) != NULL) {
+        // Pre-size the body buffer of 200 responses, unless the announced
+        // length is already over the limit. Beware of compressed transfers
+        // (and of lying servers): here the length is just a hint of the
+        // decoded size, so the pre-allocated size is capped.
+        long status = 0;
+        curl_easy_getinfo(ctx->ch, CURLINFO_RESPONSE_CODE, &status);
+        char *end;
+        errno = 0;
+        unsigned long long length = strtoull(value, &end, 10);
+        if ((status == 200) &&
+            (errno == 0) &&
+            (*end == '\0') &&
+            (length < SIZE_MAX)) {
+            if ((ctx->max_bodylen > 0) && (length > ctx->max_bodylen)) {
+                ctx->oversized = 1;
+                len = 0;
+            } else if (ctx->deferred || !is_discarding_feed(ctx->feed)) {
+                size_t size = (length < READ_URL_BODY_MAX_PRESIZE) ?
+                    length : READ_URL_BODY_MAX_PRESIZE;
+                if (ctx->bodylen < SIZE_MAX - size - 1) {
+                    reserve_url_body(ctx, ctx->bodylen + size + 1);
+                }
+            }
+        }
+        free((void *) value);
+    }
+
+    return len;
+}
+
 static size_t
 read_url_body(void *block, size_t size, size_t nmemb, void *c)
 {
     struct read_url_ctx *ctx = (struct read_url_ctx *) c;
 
     size_t block_size = size * nmemb;
-    ctx->body = realloc(ctx->body, ctx->bodylen + block_size + 1);
-    AN(ctx->body);
+    if ((ctx->max_bodylen > 0) &&
+        (ctx->bodylen + ctx->discarded + block_size > ctx->max_bodylen)) {
+        ctx->oversized = 1;
+        return 0;
+    }
+
+    unsigned feed = 0;
+    if ((ctx->feed != NULL) && !ctx->deferred) {
+        if (ctx->status < 0) {
+            curl_easy_getinfo(ctx->ch, CURLINFO_RESPONSE_CODE, &ctx->status);
+        }
+        feed = ctx->status == 200;
+    }
+
+    // Bodies of 200 responses are never accumulated if the parser is the
+    // only one interested in them.
+    if (feed && is_discarding_feed(ctx->feed)) {
+        feed_remote(ctx->vrt_ctx, ctx->feed, block, block_size);
+        ctx->discarded += block_size;
+        return block_size;
+    }
+
+    // Grow geometrically in order to keep the number of reallocations low
+    // when the final size is unknown.
+    size_t needed = ctx->bodylen + block_size + 1;
+    if (needed > ctx->bodysize) {
+        size_t size = ctx->bodysize * 2;
+        if (size < READ_URL_BODY_MIN_SIZE) {
+            size = READ_URL_BODY_MIN_SIZE;
+        }
+        if (size < needed) {
+            size = needed;
+        }
+        reserve_url_body(ctx, size);
+    }
 
     memcpy(&(ctx->body[ctx->bodylen]), block, block_size);
     ctx->bodylen += block_size;
     ctx->body[ctx->bodylen] = '\0';
 
+    if (feed) {
+        feed_remote(ctx->vrt_ctx, ctx->feed, block, block_size);
+    }
+
     return block_size;
 }
 
-static char *
-read_url(VRT_CTX, remote_t *remote)
+static CURL *
+get_url_handle(remote_t *remote, remote_mirror_t *mirror)
 {
-    struct read_url_ctx read_url_ctx = {
-        .body = strdup(""),
-        .bodylen = 0
-    };
-    AN(read_url_ctx.body);
+    if (mirror->handle != NULL) {
+        return mirror->handle;
+    }
 
     CURL *ch = curl_easy_init();
     AN(ch);
     curl_easy_setopt(ch, CURLOPT_HTTPGET, 1L);
-    curl_easy_setopt(ch, CURLOPT_URL, remote->location.parsed);
+    curl_easy_setopt(ch, CURLOPT_URL, mirror->parsed);
     curl_easy_setopt(ch, CURLOPT_NOSIGNAL, 1L);
     curl_easy_setopt(ch, CURLOPT_NOPROGRESS, 1L);
     curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, read_url_body);
-    curl_easy_setopt(ch, CURLOPT_WRITEDATA, &read_url_ctx);
+    curl_easy_setopt(ch, CURLOPT_HEADERFUNCTION, read_url_header);
     if (remote->curl.connection_timeout > 0) {
 #ifdef HAVE_CURLOPT_CONNECTTIMEOUT_MS
         curl_easy_setopt(ch, CURLOPT_CONNECTTIMEOUT_MS, remote->curl.connection_timeout);
@@ -427,29 +2851,480 @@ read_url(VRT_CTX, remote_t *remote)
     if (remote->curl.proxy != NULL) {
         curl_easy_setopt(ch, CURLOPT_PROXY, remote->curl.proxy);
     }
+    if (remote->curl.http2) {
+#if LIBCURL_VERSION_NUM >= 0x072f00
+        curl_easy_setopt(ch, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072b00
+        curl_easy_setopt(ch, CURLOPT_PIPEWAIT, 1L);
+#endif
+    }
+    if (remote->curl.compression) {
+        // Empty string means advertising all encodings supported by libcurl
+        // (gzip, deflate, br, zstd, etc., depending on how it was built).
+        // Responses are transparently decoded.
+#if LIBCURL_VERSION_NUM >= 0x071506
+        curl_easy_setopt(ch, CURLOPT_ACCEPT_ENCODING, "");
+#else
+        curl_easy_setopt(ch, CURLOPT_ENCODING, "");
+#endif
+    }
+    curl_easy_setopt(ch, CURLOPT_SHARE, get_share());
+
+    mirror->handle = ch;
+    return ch;
+}
+
+static void
+set_url_timeout(CURL *ch, unsigned timeout)
+{
+#ifdef HAVE_CURLOPT_TIMEOUT_MS
+    curl_easy_setopt(ch, CURLOPT_TIMEOUT_MS, timeout);
+#else
+    curl_easy_setopt(ch, CURLOPT_TIMEOUT, timeout / 1000);
+#endif
+}
+
+// Turns the request into a long poll (i.e. blocking query) if 'watch' is
+// enabled, or restores the regular request otherwise. Servers are asked to
+// hold the request until contents change or the wait timeout elapses using
+// the 'Prefer: wait' header (RFC 7240) and, for servers reporting an index
+// of the contents (e.g. Consul), the 'index' & 'wait' query parameters.
+static void
+set_url_watch(
+    remote_t *remote, struct read_url_ctx *read_url_ctx, unsigned watch)
+{
+    CURL *ch = read_url_ctx->ch;
+    const char *parsed = read_url_ctx->mirror->parsed;
+
+    if (watch) {
+        unsigned wait = (remote->curl.watch_timeout + 999) / 1000;
+
+        if (remote->state.validators.index != NULL) {
+            char *url;
+            assert(asprintf(
+                &url, "%s%cindex=%s&wait=%us",
+                parsed, (strchr(parsed, '?') != NULL) ? '&' : '?',
+                remote->state.validators.index, wait) > 0);
+            curl_easy_setopt(ch, CURLOPT_URL, url);
+            free((void *) url);
+        } else {
+            curl_easy_setopt(ch, CURLOPT_URL, parsed);
+        }
+
+        char *header;
+        assert(asprintf(&header, "Prefer: wait=%u", wait) > 0);
+        read_url_ctx->headers = curl_slist_append(read_url_ctx->headers, header);
+        AN(read_url_ctx->headers);
+        free((void *) header);
+
+        // The server is allowed to hold the request during the whole wait
+        // timeout before sending the response.
+        if (remote->curl.transfer_timeout > 0) {
+            set_url_timeout(
+                ch, remote->curl.transfer_timeout + remote->curl.watch_timeout);
+        }
+    } else {
+        curl_easy_setopt(ch, CURLOPT_URL, parsed);
+        if (remote->curl.transfer_timeout > 0) {
+            set_url_timeout(ch, remote->curl.transfer_timeout);
+        }
+    }
+}
+
+// Prepares the transfer of a mirror of a HTTP location using its persistent
+// handle. The transfer must be executed (i.e. curl_easy_perform() or a
+// multi handle) and then completed using finish_url() (or aborted using
+// free_url()).
+static struct read_url_ctx *
+start_url(
+    VRT_CTX, remote_t *remote, unsigned mirror, unsigned conditional,
+    unsigned watch, struct remote_feed *feed)
+{
+    assert(mirror < remote->location.nmirrors);
+    remote_mirror_t *pmirror = &remote->location.mirrors[mirror];
+    CURL *ch = get_url_handle(remote, pmirror);
+
+    struct read_url_ctx *result = malloc(sizeof(struct read_url_ctx));
+    AN(result);
+    result->vrt_ctx = ctx;
+    result->mirror = pmirror;
+    result->ch = ch;
+    result->status = -1;
+    result->feed = feed;
+    result->deferred = remote->location.nmirrors > 1;
+    result->headers = NULL;
+    result->validated = 0;
+    result->body = strdup("");
+    AN(result->body);
+    result->bodylen = 0;
+    result->bodysize = 1;
+    result->discarded = 0;
+    result->max_bodylen = remote->curl.max_body_size;
+    result->oversized = 0;
+    result->etag = NULL;
+    result->last_modified = NULL;
+    result->index = NULL;
+    result->patch = REMOTE_PATCH_NONE;
+
+    curl_easy_setopt(ch, CURLOPT_WRITEDATA, result);
+    curl_easy_setopt(ch, CURLOPT_HEADERDATA, result);
+
+    if (conditional) {
+        char *header;
+        if (remote->state.validators.etag != NULL) {
+            assert(asprintf(
+                &header, "If-None-Match: %s",
+                remote->state.validators.etag) > 0);
+            result->headers = curl_slist_append(result->headers, header);
+            AN(result->headers);
+            free((void *) header);
+            result->validated = 1;
+
+            // Delta encoding (RFC 3229): the server may answer with a patch
+            // relative to the version identified by the ETag.
+            if (remote->patch != NULL) {
+                result->headers = curl_slist_append(
+                    result->headers, "A-IM: merge-patch, json-patch");
+                AN(result->headers);
+            }
+        }
+        if (remote->state.validators.last_modified != NULL) {
+            assert(asprintf(
+                &header, "If-Modified-Since: %s",
+                remote->state.validators.last_modified) > 0);
+            result->headers = curl_slist_append(result->headers, header);
+            AN(result->headers);
+            free((void *) header);
+            result->validated = 1;
+        }
+    }
+    if (remote->curl.watch_timeout > 0) {
+        set_url_watch(remote, result, conditional && watch);
+    }
+    curl_easy_setopt(ch, CURLOPT_HTTPHEADER, result->headers);
+
+    return result;
+}
+
+static void
+free_url(struct read_url_ctx *read_url_ctx)
+{
+    CURL *ch = read_url_ctx->ch;
+
+    free((void *) read_url_ctx->body);
+    free((void *) read_url_ctx->etag);
+    free((void *) read_url_ctx->last_modified);
+    free((void *) read_url_ctx->index);
+
+    curl_easy_setopt(ch, CURLOPT_WRITEDATA, NULL);
+    curl_easy_setopt(ch, CURLOPT_HEADERDATA, NULL);
+    curl_easy_setopt(ch, CURLOPT_HTTPHEADER, NULL);
+    if (read_url_ctx->headers != NULL) {
+        curl_slist_free_all(read_url_ctx->headers);
+    }
+    free((void *) read_url_ctx);
+}
 
+static char *
+finish_url(
+    VRT_CTX, remote_t *remote, struct read_url_ctx *read_url_ctx,
+    CURLcode cr, unsigned *unmodified)
+{
+    CURL *ch = read_url_ctx->ch;
     char *result = NULL;
-    CURLcode cr = curl_easy_perform(ch);
+
+    *unmodified = 0;
+
     if (cr == CURLE_OK) {
         long status;
         curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, &status);
-        if (status == 200) {
-            result = read_url_ctx.body;
+#if LIBCURL_VERSION_NUM >= 0x073700
+        curl_off_t bytes;
+        curl_easy_getinfo(ch, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+#else
+        double bytes;
+        curl_easy_getinfo(ch, CURLINFO_SIZE_DOWNLOAD, &bytes);
+#endif
+        INC_REMOTE_COUNTER(remote, transfers.bytes, (uint64_t) bytes);
+        INC_REMOTE_COUNTER(
+            remote, transfers.decoded_bytes,
+            read_url_ctx->bodylen + read_url_ctx->discarded);
+        if ((status == 200) ||
+            ((status == 226) &&
+             (read_url_ctx->patch != REMOTE_PATCH_NONE) &&
+             (remote->patch != NULL))) {
+            result = read_url_ctx->body;
+            remote->state.patch = (status == 226) ?
+                read_url_ctx->patch : REMOTE_PATCH_NONE;
+            if ((status == 200) && read_url_ctx->deferred) {
+                feed_remote(
+                    ctx, read_url_ctx->feed, result, read_url_ctx->bodylen);
+            }
+
+            reset_validators(remote);
+            remote->state.validators.etag = read_url_ctx->etag;
+            read_url_ctx->etag = NULL;
+            remote->state.validators.last_modified = read_url_ctx->last_modified;
+            read_url_ctx->last_modified = NULL;
+            remote->state.validators.index = read_url_ctx->index;
+            read_url_ctx->index = NULL;
+            read_url_ctx->body = NULL;
+        } else if ((status == 304) && read_url_ctx->validated) {
+            *unmodified = 1;
         } else {
             LOG(ctx, LOG_ERR,
                 "Failed to fetch remote (location=%s, status=%ld)",
-                remote->location.raw, status);
+                read_url_ctx->mirror->raw, status);
         }
+    } else if (read_url_ctx->oversized) {
+        LOG(ctx, LOG_ERR,
+            "Failed to fetch remote (location=%s): body exceeds %u bytes",
+            read_url_ctx->mirror->raw, remote->curl.max_body_size);
     } else {
         LOG(ctx, LOG_ERR,
             "Failed to fetch remote (location=%s): %s",
-            remote->location.raw, curl_easy_strerror(cr));
+            read_url_ctx->mirror->raw, curl_easy_strerror(cr));
+    }
+
+    free_url(read_url_ctx);
+
+    return result;
+}
+
+// Transfer of a HTTP location listing several mirrors (hedged requests).
+// Mirrors are requested in order: the next one is started once previous
+// ones have been running for 'curl.hedge_delay' milliseconds without
+// responding, or as soon as all of them failed. The first successful
+// response wins, and all other in-progress transfers are aborted. Transfers
+// are executed using a multi handle.
+struct read_mirrors_ctx {
+    const struct vrt_ctx *vrt_ctx;
+    remote_t *remote;
+    CURLM *multi;
+    // Private pointer of the easy handles (i.e. CURLOPT_PRIVATE).
+    void *priv;
+    unsigned conditional;
+    unsigned watch;
+    struct remote_feed *feed;
+    // In-progress transfers, indexed by mirror (NULL if not running).
+    struct read_url_ctx **urls;
+    unsigned running;
+    // Next mirror to be requested.
+    unsigned next;
+    // Monotonic time (milliseconds) of the last started transfer.
+    uint64_t started;
+    // Set once a transfer wins or all of them failed.
+    unsigned done;
+    char *result;
+    unsigned unmodified;
+};
+
+static uint64_t
+get_mirrors_time()
+{
+    struct timespec now;
+    AZ(clock_gettime(CLOCK_MONOTONIC, &now));
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void
+start_mirror(struct read_mirrors_ctx *ctx)
+{
+    remote_t *remote = ctx->remote;
+    assert(ctx->next < remote->location.nmirrors);
+
+    unsigned mirror = ctx->next++;
+    struct read_url_ctx *url = start_url(
+        ctx->vrt_ctx, remote, mirror, ctx->conditional, ctx->watch,
+        ctx->feed);
+    curl_easy_setopt(url->ch, CURLOPT_PRIVATE, ctx->priv);
+    AZ(curl_multi_add_handle(ctx->multi, url->ch));
+
+    if (ctx->running > 0) {
+        INC_REMOTE_COUNTER(remote, fetches.hedged, 1);
+    }
+    ctx->urls[mirror] = url;
+    ctx->running++;
+    ctx->started = get_mirrors_time();
+}
+
+static struct read_url_ctx *
+stop_mirror(struct read_mirrors_ctx *ctx, unsigned mirror)
+{
+    struct read_url_ctx *result = ctx->urls[mirror];
+    AN(result);
+    AZ(curl_multi_remove_handle(ctx->multi, result->ch));
+    curl_easy_setopt(result->ch, CURLOPT_PRIVATE, NULL);
+    ctx->urls[mirror] = NULL;
+    ctx->running--;
+    return result;
+}
+
+static void
+abort_mirrors(struct read_mirrors_ctx *ctx)
+{
+    for (unsigned i = 0; i < ctx->remote->location.nmirrors; i++) {
+        if (ctx->urls[i] != NULL) {
+            free_url(stop_mirror(ctx, i));
+        }
+    }
+    AZ(ctx->running);
+}
+
+// Starts the transfer of the first mirror, which must be executed using
+// 'multi' and then completed using complete_mirror(). Long polls are never
+// hedged: the server is expected to hold them.
+static struct read_mirrors_ctx *
+start_mirrors(
+    VRT_CTX, remote_t *remote, CURLM *multi, void *priv,
+    unsigned conditional, unsigned watch, struct remote_feed *feed)
+{
+    struct read_mirrors_ctx *result = malloc(sizeof(struct read_mirrors_ctx));
+    AN(result);
+    result->vrt_ctx = ctx;
+    result->remote = remote;
+    result->multi = multi;
+    result->priv = priv;
+    result->conditional = conditional;
+    result->watch = watch;
+    result->feed = feed;
+    result->urls = calloc(
+        remote->location.nmirrors, sizeof(struct read_url_ctx *));
+    AN(result->urls);
+    result->running = 0;
+    result->next = 0;
+    result->started = 0;
+    result->done = 0;
+    result->result = NULL;
+    result->unmodified = 0;
+
+    start_mirror(result);
+
+    return result;
+}
+
+// Starts the next mirror if the hedge delay elapsed. Returns the number of
+// milliseconds until the next mirror should be started (-1 if none).
+static long
+poll_mirrors(struct read_mirrors_ctx *ctx)
+{
+    remote_t *remote = ctx->remote;
+
+    if (ctx->done ||
+        ctx->watch ||
+        (remote->curl.hedge_delay == 0) ||
+        (ctx->next >= remote->location.nmirrors)) {
+        return -1;
+    }
+
+    uint64_t elapsed = get_mirrors_time() - ctx->started;
+    if (elapsed < remote->curl.hedge_delay) {
+        return remote->curl.hedge_delay - elapsed;
+    }
+
+    start_mirror(ctx);
+    return (ctx->next < remote->location.nmirrors) ?
+        (long) remote->curl.hedge_delay : -1;
+}
+
+// Completes the transfer executed using the easy handle 'ch'.
+static void
+complete_mirror(struct read_mirrors_ctx *ctx, CURL *ch, CURLcode cr)
+{
+    remote_t *remote = ctx->remote;
+
+    unsigned mirror;
+    for (mirror = 0; mirror < remote->location.nmirrors; mirror++) {
+        if ((ctx->urls[mirror] != NULL) && (ctx->urls[mirror]->ch == ch)) {
+            break;
+        }
+    }
+    assert(mirror < remote->location.nmirrors);
+
+    unsigned unmodified;
+    char *contents = finish_url(
+        ctx->vrt_ctx, remote, stop_mirror(ctx, mirror), cr, &unmodified);
+
+    if ((contents != NULL) || unmodified) {
+        abort_mirrors(ctx);
+        ctx->done = 1;
+        ctx->result = contents;
+        ctx->unmodified = unmodified;
+    } else if (ctx->running == 0) {
+        if (ctx->next < remote->location.nmirrors) {
+            start_mirror(ctx);
+        } else {
+            ctx->done = 1;
+        }
     }
+}
+
+static unsigned
+is_done_mirrors(struct read_mirrors_ctx *ctx)
+{
+    return ctx->done;
+}
+
+// Releases the transfer, aborting any in-progress mirror, and returns the
+// winning contents (if any).
+static char *
+finish_mirrors(struct read_mirrors_ctx *ctx, unsigned *unmodified)
+{
+    abort_mirrors(ctx);
+    char *result = ctx->result;
+    *unmodified = ctx->unmodified;
+    free((void *) ctx->urls);
+    free((void *) ctx);
+    return result;
+}
+
+static char *
+read_mirrors(
+    VRT_CTX, remote_t *remote, unsigned conditional, unsigned *unmodified,
+    struct remote_feed *feed)
+{
+    CURLM *multi = curl_multi_init();
+    AN(multi);
 
-    if (result == NULL) {
-        free((void *) read_url_ctx.body);
+    struct read_mirrors_ctx *read_mirrors_ctx = start_mirrors(
+        ctx, remote, multi, NULL, conditional, 0, feed);
+    while (!read_mirrors_ctx->done) {
+        long timeout = poll_mirrors(read_mirrors_ctx);
+        int running, pending;
+        curl_multi_perform(multi, &running);
+        CURLMsg *msg;
+        while (!read_mirrors_ctx->done &&
+               ((msg = curl_multi_info_read(multi, &pending)) != NULL)) {
+            if (msg->msg == CURLMSG_DONE) {
+                complete_mirror(
+                    read_mirrors_ctx, msg->easy_handle, msg->data.result);
+            }
+        }
+        if (!read_mirrors_ctx->done) {
+            curl_multi_wait(
+                multi, NULL, 0,
+                ((timeout >= 0) && (timeout < 1000)) ? timeout : 1000, NULL);
+        }
     }
+    char *result = finish_mirrors(read_mirrors_ctx, unmodified);
+
+    curl_multi_cleanup(multi);
 
-    curl_easy_cleanup(ch);
     return result;
 }
+
+static char *
+read_url(
+    VRT_CTX, remote_t *remote, unsigned conditional, unsigned *unmodified,
+    struct remote_feed *feed)
+{
+    if (remote->location.nmirrors > 1) {
+        return read_mirrors(ctx, remote, conditional, unmodified, feed);
+    }
+
+    struct read_url_ctx *read_url_ctx = start_url(
+        ctx, remote, 0, conditional, 0, feed);
+    CURLcode cr = curl_easy_perform(read_url_ctx->ch);
+    return finish_url(ctx, remote, read_url_ctx, cr, unmodified);
+}
@@ -1,6 +1,64 @@
 #ifndef CFG_REMOTE_H_INCLUDED
 #define CFG_REMOTE_H_INCLUDED
 
+#include "vsha256.h"
+
+// Incremental parser of line-oriented contents. Lines are fed while contents
+// are being read (i.e. from the curl write callback or while reading local
+// files), so parsing doesn't require walking the whole document again.
+typedef struct remote_stream {
+    // Allocates a new parsing state.
+    void *(*start)(VRT_CTX, void *ptr);
+    // Parses a NUL-terminated line (without line terminator). Returns 0 on
+    // errors (i.e. no more lines will be fed).
+    unsigned (*line)(VRT_CTX, void *ptr, void *state, char *line);
+    // Installs the parsed contents if 'commit' is enabled and no errors were
+    // found, and releases the parsing state. Returns 1 on success.
+    unsigned (*finish)(
+        VRT_CTX, void *ptr, void *state, unsigned is_backup, unsigned commit);
+} remote_stream_t;
+
+struct remote_feed;
+
+// Local file matching a glob location (e.g. '/etc/varnish/cfg.d/*.json').
+typedef struct remote_part {
+    const char *path;
+    const char *contents;
+    // Set when the file is new or changed since the last successful load.
+    // Otherwise, 'contents' are the ones already parsed during that load.
+    unsigned changed;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtim;
+    off_t size;
+} remote_part_t;
+
+// Mirror of a HTTP location. Locations may list several whitespace-separated
+// URLs (e.g. 'https://a/cfg.json https://b/cfg.json'), in order of
+// preference.
+typedef struct remote_mirror {
+    const char *raw;
+    const char *parsed;
+    // Persistent easy handle (i.e. 'CURL *'), lazily created on the first
+    // fetch and reused afterwards in order to keep connections alive.
+    // Only used while reloading the remote (see 'refresher.reloading').
+    void *handle;
+} remote_mirror_t;
+
+// VCL using a remote. Remotes may be shared by objects with identical
+// definitions in different VCLs (or in the same VCL).
+typedef struct remote_user {
+    unsigned magic;
+    #define REMOTE_USER_MAGIC 0x51d2c7e0
+
+    struct vcl *vcl;
+    // Number of objects in the VCL using the remote.
+    unsigned refs;
+    unsigned warm;
+
+    VTAILQ_ENTRY(remote_user) list;
+} remote_user_t;
+
 typedef struct remote {
     unsigned magic;
     #define REMOTE_MAGIC 0x9774a43f
@@ -8,10 +66,17 @@ typedef struct remote {
     struct {
         const char *raw;
         const char *parsed;
+        // HTTP mirrors (NULL for local files). 'parsed' is the URL of the
+        // first one.
+        remote_mirror_t *mirrors;
+        unsigned nmirrors;
     } location;
     const char *backup;
     unsigned automated_backups;
     unsigned period;
+    // If disabled, raw contents are released once parsed, instead of being
+    // kept in 'state.contents'.
+    unsigned keep_contents;
     struct {
         unsigned connection_timeout;
         unsigned transfer_timeout;
@@ -20,30 +85,221 @@ typedef struct remote {
         const char *ssl_cafile;
         const char *ssl_capath;
         const char *proxy;
+        unsigned http2;
+        unsigned compression;
+        unsigned max_body_size;
+        // Maximum time (milliseconds) background fetches are held by the
+        // server waiting for changes (0 means disabling long polling).
+        unsigned watch_timeout;
+        // Time (milliseconds) after which the next mirror is requested if
+        // previous ones didn't respond yet (0 means requesting the next
+        // mirror only after previous ones failed).
+        unsigned hedge_delay;
     } curl;
-    char *(*read)(VRT_CTX, struct remote *);
+    char *(*read)(
+        VRT_CTX, struct remote *, unsigned, unsigned *, struct remote_feed *);
+    // Contents are either parsed incrementally using 'stream' (if not NULL)
+    // or once completely read using 'callback'.
+    unsigned (*callback)(VRT_CTX, void *, char *, unsigned);
+    const remote_stream_t *stream;
+    // Optional parser of glob locations, handling matching files one by one
+    // (in lexical order). If NULL, concatenated contents of all files are
+    // parsed using 'callback' or 'stream'.
+    unsigned (*parts)(VRT_CTX, void *, const remote_part_t *, unsigned);
+    // Optional parser of patches relative to the installed contents. If not
+    // NULL, HTTP servers are allowed to answer conditional fetches using
+    // patches (i.e. '226 IM Used' responses). Returns 0 if the patch can't
+    // be applied, leaving installed contents untouched.
+    unsigned (*patch)(VRT_CTX, void *, unsigned, const char *);
+    void *ptr;
 
     struct {
         unsigned version;
+        // Time of the last successful load. Atomically accessed (see
+        // get_remote_tst()).
         time_t tst;
         pthread_mutex_t mutex;
-        unsigned reloading;
+        // Raw installed contents (NULL if not kept). See 'keep_contents'.
         const char *contents;
+
+        // Validators of the last successfully loaded HTTP response or local
+        // file. Only modified while reloading the remote.
+        struct {
+            const char *etag;
+            const char *last_modified;
+            // Index of the last loaded response, as reported by servers
+            // supporting blocking queries (i.e. 'X-Consul-Index' header).
+            const char *index;
+            struct {
+                unsigned set;
+                dev_t dev;
+                ino_t ino;
+                struct timespec mtim;
+                off_t size;
+            } file;
+        } validators;
+
+        // Type of the contents being loaded, if they are a patch (i.e.
+        // REMOTE_PATCH_*). Only used while reloading the remote.
+        #define REMOTE_PATCH_NONE 0
+        #define REMOTE_PATCH_MERGE 1
+        #define REMOTE_PATCH_JSON 2
+        unsigned patch;
+
+        // Files matching glob locations. 'parts' are the ones used during
+        // the last successful load, and 'pending' the ones being loaded.
+        // Only modified while reloading the remote.
+        struct {
+            remote_part_t *parts;
+            unsigned nparts;
+            remote_part_t *pending;
+            unsigned npending;
+        } glob;
+
+        // Digest of the installed contents. Only used while reloading the
+        // remote.
+        struct {
+            unsigned set;
+            unsigned char value[SHA256_LEN];
+        } digest;
     } state;
+
+    // Updated while reloading the remote, and atomically accessed (i.e. they
+    // are read by client threads at any time).
+    struct {
+        struct {
+            // Number of fetches returning new contents.
+            uint64_t modified;
+            // Number of fetches confirming that contents didn't change (i.e.
+            // 304 responses or contents identical to the installed ones).
+            uint64_t unmodified;
+            // Number of failed fetches.
+            uint64_t failed;
+            // Number of fetches returning a patch successfully applied to
+            // the installed contents.
+            uint64_t patched;
+            // Number of fetches returning a patch that couldn't be applied,
+            // followed by a full fetch.
+            uint64_t diverged;
+            // Number of requests sent to mirrors while requests to previous
+            // mirrors were still in progress.
+            uint64_t hedged;
+        } fetches;
+        struct {
+            // Number of pushed contents successfully installed (or
+            // identical to the installed ones).
+            uint64_t accepted;
+            // Number of pushed contents rejected (e.g. parse errors).
+            uint64_t rejected;
+        } updates;
+        struct {
+            // Number of body bytes received from HTTP locations, as
+            // transferred over the wire (i.e. before decoding them).
+            uint64_t bytes;
+            // Number of body bytes received from HTTP locations, after
+            // decoding them.
+            uint64_t decoded_bytes;
+        } transfers;
+    } stats;
+
+    // Protected by 'vmod_state.backups.mutex'.
+    struct {
+        // Latest contents waiting to be written by the background writer.
+        // Contents still not written are replaced (i.e. coalesced) when
+        // reloads are faster than the disk.
+        char *pending;
+        unsigned queued;
+        unsigned busy;
+        VTAILQ_ENTRY(remote) list;
+
+        struct {
+            // Number of successfully written backups.
+            uint64_t written;
+            // Number of failed backup writes.
+            uint64_t failed;
+            // Number of backups discarded before being written because
+            // newer contents were available.
+            uint64_t coalesced;
+        } stats;
+    } backups;
+
+    // Initial load executed in the background. See load_remote(). Updated
+    // while holding 'vmod_state.remotes.mutex', but 'status' is atomically
+    // read by lookups (see join_loader()).
+    struct {
+        #define REMOTE_LOADER_IDLE 0
+        #define REMOTE_LOADER_RUNNING 1
+        #define REMOTE_LOADER_JOINING 2
+        unsigned status;
+        pthread_t thread;
+    } loader;
+
+    // Protected by 'vmod_state.remotes.mutex'.
+    struct {
+        VTAILQ_HEAD(, remote_user) users;
+        // Number of warm VCLs using the remote. Periodical reloads are only
+        // executed while this is > 0.
+        unsigned warm;
+        unsigned busy;
+        // Set while some thread is reloading the remote (i.e. background
+        // reloads, forced reloads, etc.). Reloads are serialized using this
+        // flag instead of a mutex: background reloads are started by the
+        // scheduler and completed by the worker. See lock_remote().
+        unsigned reloading;
+        // Number of threads waiting for an in-progress background reload
+        // (e.g. forced reloads, VCLs becoming cold, etc.). Long polls are
+        // cancelled and no background reloads are started while this is
+        // > 0.
+        unsigned blocked;
+        // Set by the inotify watcher when the local file has been replaced.
+        unsigned dirty;
+        // inotify watch descriptor of the directory of the local file.
+        int wd;
+        // Next scheduled reload (0 means not scheduled yet).
+        time_t next;
+        // Number of consecutive failed reloads.
+        unsigned failures;
+        VTAILQ_ENTRY(remote) list;
+    } refresher;
 } remote_t;
 
+unsigned is_valid_location(VRT_CTX, const char *location);
+
 remote_t *new_remote(
-    const char *location, const char *backup, unsigned automated_backups,
-    unsigned period, unsigned curl_connection_timeout,
-    unsigned curl_transfer_timeout, unsigned curl_ssl_verify_peer,
-    unsigned curl_ssl_verify_host, const char *curl_ssl_cafile,
-    const char *curl_ssl_capath, const char *curl_proxy);
+    VRT_CTX, const char *location, const char *backup,
+    unsigned automated_backups, unsigned period, unsigned keep_contents,
+    unsigned curl_connection_timeout, unsigned curl_transfer_timeout,
+    unsigned curl_ssl_verify_peer, unsigned curl_ssl_verify_host,
+    const char *curl_ssl_cafile, const char *curl_ssl_capath,
+    const char *curl_proxy, unsigned curl_http2, unsigned curl_compression,
+    unsigned curl_max_body_size, unsigned curl_watch_timeout,
+    unsigned curl_hedge_delay,
+    unsigned (*callback)(VRT_CTX, void *, char *, unsigned),
+    const remote_stream_t *stream,
+    unsigned (*parts)(VRT_CTX, void *, const remote_part_t *, unsigned),
+    unsigned (*patch)(VRT_CTX, void *, unsigned, const char *),
+    void *ptr);
 void free_remote(remote_t *remote);
 
+void share_remote(VRT_CTX, remote_t *remote);
+void unshare_remote(remote_t *remote, struct vcl *vcl);
+
 unsigned check_remote(
-    VRT_CTX, remote_t *remote, unsigned force_load, unsigned force_backup,
-    unsigned (*callback)(VRT_CTX, void *, char *, unsigned), void *ptr);
+    VRT_CTX, remote_t *remote, unsigned force_load, unsigned force_backup);
+
+unsigned update_remote(VRT_CTX, remote_t *remote, unsigned force_backup);
+
+unsigned warm_start_remote(VRT_CTX, remote_t *remote);
+void load_remote(VRT_CTX, remote_t *remote);
+
+unsigned inspect_remote(VRT_CTX, remote_t *remote);
+
+unsigned get_remote_counter(remote_t *remote, const char *name, uint64_t *value);
+
+void init_remotes(VRT_CTX);
+void fini_remotes(VRT_CTX);
 
-void inspect_remote(VRT_CTX, remote_t *remote);
+void warm_remotes(VRT_CTX);
+void cool_remotes(VRT_CTX);
 
 #endif
@@ -9,6 +9,7 @@
 #include "vtree.h"
 
 #include "duktape.h"
+#include "epochs.h"
 #include "remote.h"
 #include "variables.h"
 #include "helpers.h"
@@ -39,6 +40,16 @@ typedef VRBT_HEAD(regexps, regexp) regexps_t;
 
 VRBT_PROTOTYPE(regexps, regexp, tree, regexpcmp);
 
+// function_t.
+
+typedef struct function {
+    unsigned magic;
+    #define FUNCTION_MAGIC 0x6f3ad218
+
+    const char *code;
+    const char *name;
+} function_t;
+
 // engine_t & engines_t.
 
 typedef struct engine {
@@ -144,10 +155,9 @@ struct vmod_cfg_script {
     struct {
         struct lock mutex;
 
-        struct {
-            const char *code;
-            const char *name;
-        } function;
+        // Latest successfully compiled code. Read without locks (see
+        // enter_epoch()) and replaced using publish_epoch_pointer().
+        function_t *function;
 
         struct {
             pthread_cond_t cond;
@@ -1,6 +1,7 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -62,6 +63,552 @@ flush_global_variables(variables_t *variables)
     }
 }
 
+/******************************************************************************
+ * ARENAS.
+ *****************************************************************************/
+
+#define ARENA_MIN_CHUNK (16 * 1024)
+#define ARENA_ALIGN(value) \
+    (((value) + sizeof(void *) - 1) & ~((uintptr_t) sizeof(void *) - 1))
+
+static struct variables_arena_chunk *
+new_arena_chunk(struct variables_arena_chunk *previous, size_t size)
+{
+    struct variables_arena_chunk *result = malloc(
+        sizeof(struct variables_arena_chunk) + size);
+    AN(result);
+    result->previous = previous;
+    result->size = size;
+    result->used = 0;
+    return result;
+}
+
+// 'size' is a hint of the number of bytes to be allocated in the arena (e.g.
+// the length of the parsed document). Chunks grow geometrically when needed.
+variables_arena_t *
+new_variables_arena(size_t size)
+{
+    variables_arena_t *result;
+    ALLOC_OBJ(result, VARIABLES_ARENA_MAGIC);
+    AN(result);
+
+    VRBT_INIT(&result->variables);
+    result->chunk = new_arena_chunk(
+        NULL, ARENA_ALIGN((size > ARENA_MIN_CHUNK) ? size : ARENA_MIN_CHUNK));
+    result->used = 0;
+
+    return result;
+}
+
+void
+free_variables_arena(variables_arena_t *arena)
+{
+    CHECK_OBJ_NOTNULL(arena, VARIABLES_ARENA_MAGIC);
+
+    struct variables_arena_chunk *chunk = arena->chunk;
+    while (chunk != NULL) {
+        struct variables_arena_chunk *previous = chunk->previous;
+        free((void *) chunk);
+        chunk = previous;
+    }
+    arena->chunk = NULL;
+
+    FREE_OBJ(arena);
+}
+
+static void *
+alloc_arena(variables_arena_t *arena, size_t size)
+{
+    struct variables_arena_chunk *chunk = arena->chunk;
+    size = ARENA_ALIGN(size);
+
+    if (chunk->size - chunk->used < size) {
+        size_t chunk_size = 2 * chunk->size;
+        if (chunk_size < size) {
+            chunk_size = size;
+        }
+        chunk = arena->chunk = new_arena_chunk(chunk, chunk_size);
+    }
+
+    void *result = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->used += size;
+    return result;
+}
+
+// Tries to grow 'value' (ending at 'end') in place to 'len' bytes. Only
+// possible if it's the last allocation in the current chunk.
+static unsigned
+extend_arena(variables_arena_t *arena, const char *value, const char *end, size_t len)
+{
+    struct variables_arena_chunk *chunk = arena->chunk;
+    char *top = chunk->data + chunk->used;
+
+    if ((char *) ARENA_ALIGN((uintptr_t) end) == top) {
+        char *new_top = (char *) ARENA_ALIGN((uintptr_t) (value + len));
+        if (new_top <= chunk->data + chunk->size) {
+            arena->used += new_top - top;
+            chunk->used = new_top - chunk->data;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Allocates a variable (not inserted in the tree of the arena yet) in a
+// single block, with the value at the end so it can be extended in place
+// (see append_arena_variable()).
+variable_t *
+new_arena_variable(
+    variables_arena_t *arena, const char *name, size_t len, const char *value)
+{
+    CHECK_OBJ_NOTNULL(arena, VARIABLES_ARENA_MAGIC);
+
+    size_t value_len = strlen(value) + 1;
+    char *ptr = alloc_arena(arena, sizeof(variable_t) + len + 1 + value_len);
+
+    variable_t *result = (variable_t *) ptr;
+    INIT_OBJ(result, VARIABLE_MAGIC);
+    ptr += sizeof(variable_t);
+
+    memcpy(ptr, name, len);
+    ptr[len] = '\0';
+    result->name = ptr;
+    ptr += len + 1;
+
+    memcpy(ptr, value, value_len);
+    result->value = ptr;
+
+    return result;
+}
+
+void
+set_arena_variable(
+    variables_arena_t *arena, variable_t *variable, const char *value)
+{
+    CHECK_OBJ_NOTNULL(arena, VARIABLES_ARENA_MAGIC);
+    CHECK_OBJ_NOTNULL(variable, VARIABLE_MAGIC);
+
+    size_t len = strlen(value) + 1;
+    size_t old_len = strlen(variable->value) + 1;
+    if ((len > old_len) &&
+        !extend_arena(arena, variable->value, variable->value + old_len, len)) {
+        variable->value = alloc_arena(arena, len);
+    }
+    memcpy(variable->value, value, len);
+}
+
+// Appends 'value' to the current value of 'variable', using 'delimiter'
+// unless the current value is empty.
+void
+append_arena_variable(
+    variables_arena_t *arena, variable_t *variable, const char *delimiter,
+    const char *value)
+{
+    CHECK_OBJ_NOTNULL(arena, VARIABLES_ARENA_MAGIC);
+    CHECK_OBJ_NOTNULL(variable, VARIABLE_MAGIC);
+
+    size_t old_len = strlen(variable->value);
+    if (old_len == 0) {
+        delimiter = "";
+    }
+    size_t delimiter_len = strlen(delimiter);
+    size_t len = old_len + delimiter_len + strlen(value) + 1;
+
+    if (!extend_arena(arena, variable->value, variable->value + old_len + 1, len)) {
+        char *ptr = alloc_arena(arena, len);
+        memcpy(ptr, variable->value, old_len);
+        variable->value = ptr;
+    }
+    memcpy(variable->value + old_len, delimiter, delimiter_len);
+    strcpy(variable->value + old_len + delimiter_len, value);
+}
+
+// Returns a new arena with a copy of the variables in 'arena' if most of the
+// allocated bytes belong to removed variables or replaced values, or 'arena'
+// otherwise. The original arena is not released.
+variables_arena_t *
+compact_variables_arena(variables_arena_t *arena)
+{
+    CHECK_OBJ_NOTNULL(arena, VARIABLES_ARENA_MAGIC);
+
+    size_t used = 0;
+    variable_t *variable;
+    VRBT_FOREACH(variable, variables, &arena->variables) {
+        CHECK_OBJ_NOTNULL(variable, VARIABLE_MAGIC);
+        used += ARENA_ALIGN(
+            sizeof(variable_t) +
+            strlen(variable->name) + 1 +
+            strlen(variable->value) + 1);
+    }
+
+    if (arena->used <= 2 * used + ARENA_MIN_CHUNK) {
+        return arena;
+    }
+
+    variables_arena_t *result = new_variables_arena(used);
+    VRBT_FOREACH(variable, variables, &arena->variables) {
+        AZ(VRBT_INSERT(variables, &result->variables, new_arena_variable(
+            result, variable->name, strlen(variable->name), variable->value)));
+    }
+
+    return result;
+}
+
+/******************************************************************************
+ * SNAPSHOTS.
+ *****************************************************************************/
+
+// Maximum number of displacements tried for every bucket of the perfect hash
+// before giving up (i.e. falling back to binary searches).
+#define SNAPSHOT_MAX_SEED (1 << 16)
+
+// FNV-1a, followed by the MurmurHash3 finalizer.
+static uint64_t
+hash_snapshot_name(const char *name)
+{
+    uint64_t result = 0xcbf29ce484222325ULL;
+    for (; *name != '\0'; name++) {
+        result ^= (unsigned char) *name;
+        result *= 0x100000001b3ULL;
+    }
+    result ^= result >> 33;
+    result *= 0xff51afd7ed558ccdULL;
+    result ^= result >> 33;
+    result *= 0xc4ceb9fe1a85ec53ULL;
+    result ^= result >> 33;
+    return result;
+}
+
+static unsigned
+get_snapshot_bucket(uint64_t hash, unsigned n)
+{
+    return (hash >> 32) % n;
+}
+
+static unsigned
+get_snapshot_slot(uint64_t hash, int32_t seed, unsigned n)
+{
+    if (seed < 0) {
+        return -seed - 1;
+    }
+    hash ^= (uint64_t) seed * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 32;
+    return hash % n;
+}
+
+// Hash & displace: buckets are handled from the largest to the smallest one,
+// looking for a displacement mapping all their entries to free slots.
+// Entries of single-entry buckets are then directly assigned to the
+// remaining free slots. Returns the slot of every entry, or NULL on failure.
+static uint32_t *
+build_snapshot_index(
+    const struct variables_snapshot_entry *entries, unsigned n, int32_t *seeds)
+{
+    uint32_t *result = malloc(n * sizeof(uint32_t));
+    AN(result);
+    unsigned *counts = calloc(n + 1, sizeof(unsigned));
+    AN(counts);
+    unsigned *bucketed = malloc(n * sizeof(unsigned));
+    AN(bucketed);
+    unsigned *order = malloc(n * sizeof(unsigned));
+    AN(order);
+    unsigned *sizes = calloc(n + 1, sizeof(unsigned));
+    AN(sizes);
+    unsigned char *taken = calloc(n, sizeof(unsigned char));
+    AN(taken);
+    unsigned failed = 0;
+
+    // Group entries by bucket (counting sort).
+    for (unsigned i = 0; i < n; i++) {
+        counts[get_snapshot_bucket(entries[i].hash, n) + 1]++;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        counts[i + 1] += counts[i];
+    }
+    for (unsigned i = 0; i < n; i++) {
+        unsigned bucket = get_snapshot_bucket(entries[i].hash, n);
+        bucketed[counts[bucket] + sizes[bucket]++] = i;
+    }
+
+    // Sort buckets by size, largest first (counting sort).
+    unsigned *offsets = calloc(n + 2, sizeof(unsigned));
+    AN(offsets);
+    for (unsigned i = 0; i < n; i++) {
+        offsets[n - sizes[i] + 1]++;
+    }
+    for (unsigned i = 0; i <= n; i++) {
+        offsets[i + 1] += offsets[i];
+    }
+    for (unsigned i = 0; i < n; i++) {
+        order[offsets[n - sizes[i]]++] = i;
+    }
+    free((void *) offsets);
+
+    unsigned k;
+    for (k = 0; (k < n) && (sizes[order[k]] > 1) && !failed; k++) {
+        unsigned bucket = order[k];
+        unsigned *members = &bucketed[counts[bucket]];
+        unsigned size = sizes[bucket];
+        int32_t seed;
+        for (seed = 0; seed < SNAPSHOT_MAX_SEED; seed++) {
+            unsigned j;
+            for (j = 0; j < size; j++) {
+                unsigned slot = get_snapshot_slot(entries[members[j]].hash, seed, n);
+                if (taken[slot]) {
+                    break;
+                }
+                taken[slot] = 1;
+                result[members[j]] = slot;
+            }
+            if (j == size) {
+                break;
+            }
+            while (j > 0) {
+                taken[result[members[--j]]] = 0;
+            }
+        }
+        if (seed < SNAPSHOT_MAX_SEED) {
+            seeds[bucket] = seed;
+        } else {
+            failed = 1;
+        }
+    }
+
+    if (!failed) {
+        unsigned slot = 0;
+        for (; (k < n) && (sizes[order[k]] == 1); k++) {
+            unsigned bucket = order[k];
+            while (taken[slot]) {
+                slot++;
+            }
+            taken[slot] = 1;
+            result[bucketed[counts[bucket]]] = slot;
+            seeds[bucket] = -(int32_t) slot - 1;
+        }
+        for (; k < n; k++) {
+            seeds[order[k]] = 0;
+        }
+    } else {
+        free((void *) result);
+        result = NULL;
+    }
+
+    free((void *) counts);
+    free((void *) bucketed);
+    free((void *) order);
+    free((void *) sizes);
+    free((void *) taken);
+
+    return result;
+}
+
+// Contents of the snapshot (i.e. header, entries, index & strings) are
+// stored in a single allocation, so the whole snapshot is released at once.
+variables_snapshot_t *
+new_variables_snapshot(variables_t *variables)
+{
+    variable_t *variable;
+    unsigned n = 0;
+    size_t strings = 0;
+    if (variables != NULL) {
+        VRBT_FOREACH(variable, variables, variables) {
+            CHECK_OBJ_NOTNULL(variable, VARIABLE_MAGIC);
+            n++;
+            strings += strlen(variable->name) + strlen(variable->value) + 2;
+        }
+    }
+
+    size_t size =
+        sizeof(variables_snapshot_t) +
+        n * sizeof(struct variables_snapshot_entry) +
+        n * sizeof(int32_t) +
+        n * sizeof(uint32_t) +
+        strings;
+    char *ptr = malloc(size);
+    AN(ptr);
+
+    variables_snapshot_t *result = (variables_snapshot_t *) ptr;
+    INIT_OBJ(result, VARIABLES_SNAPSHOT_MAGIC);
+    result->refs = 1;
+    result->n = n;
+    ptr += sizeof(variables_snapshot_t);
+    result->entries = (struct variables_snapshot_entry *) ptr;
+    ptr += n * sizeof(struct variables_snapshot_entry);
+    result->seeds = (int32_t *) ptr;
+    ptr += n * sizeof(int32_t);
+    result->sorted = (uint32_t *) ptr;
+    ptr += n * sizeof(uint32_t);
+
+    // Entries are first stored in lexical order.
+    unsigned i = 0;
+    if (variables != NULL) {
+        VRBT_FOREACH(variable, variables, variables) {
+            size_t len = strlen(variable->name) + 1;
+            memcpy(ptr, variable->name, len);
+            result->entries[i].name = ptr;
+            result->entries[i].hash = hash_snapshot_name(ptr);
+            ptr += len;
+            len = strlen(variable->value) + 1;
+            memcpy(ptr, variable->value, len);
+            result->entries[i].value = ptr;
+            ptr += len;
+            result->sorted[i] = i;
+            i++;
+        }
+    }
+
+    // Then they are moved to their slots.
+    uint32_t *slots = (n > 0) ?
+        build_snapshot_index(result->entries, n, result->seeds) : NULL;
+    if (slots != NULL) {
+        struct variables_snapshot_entry *sorted = malloc(
+            n * sizeof(struct variables_snapshot_entry));
+        AN(sorted);
+        memcpy(sorted, result->entries, n * sizeof(struct variables_snapshot_entry));
+        for (i = 0; i < n; i++) {
+            result->entries[slots[i]] = sorted[i];
+            result->sorted[i] = slots[i];
+        }
+        free((void *) sorted);
+        free((void *) slots);
+    } else {
+        result->seeds = NULL;
+    }
+
+    return result;
+}
+
+void
+acquire_variables_snapshot(variables_snapshot_t *snapshot)
+{
+    CHECK_OBJ_NOTNULL(snapshot, VARIABLES_SNAPSHOT_MAGIC);
+    AN(__atomic_fetch_add(&snapshot->refs, 1, __ATOMIC_RELAXED));
+}
+
+void
+release_variables_snapshot(variables_snapshot_t *snapshot)
+{
+    CHECK_OBJ_NOTNULL(snapshot, VARIABLES_SNAPSHOT_MAGIC);
+    if (__atomic_sub_fetch(&snapshot->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        snapshot->magic = 0;
+        free((void *) snapshot);
+    }
+}
+
+// Index (in 'sorted') of the first entry >= 'name'.
+static unsigned
+lower_bound_snapshot(const variables_snapshot_t *snapshot, const char *name)
+{
+    unsigned low = 0;
+    unsigned high = snapshot->n;
+    while (low < high) {
+        unsigned middle = low + (high - low) / 2;
+        if (strcmp(snapshot->entries[snapshot->sorted[middle]].name, name) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Range [first, last) (in 'sorted') of the entries starting with 'prefix'.
+// Matching entries are contiguous in lexical order, so both ends are found
+// using binary searches.
+static void
+prefix_range_snapshot(
+    const variables_snapshot_t *snapshot, const char *prefix,
+    unsigned *first, unsigned *last)
+{
+    if (prefix == NULL) {
+        prefix = "";
+    }
+    size_t len = strlen(prefix);
+
+    unsigned low = lower_bound_snapshot(snapshot, prefix);
+    unsigned high = snapshot->n;
+    *first = low;
+    while (low < high) {
+        unsigned middle = low + (high - low) / 2;
+        if (strncmp(snapshot->entries[snapshot->sorted[middle]].name, prefix, len) == 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    *last = low;
+}
+
+const struct variables_snapshot_entry *
+find_snapshot_variable(const variables_snapshot_t *snapshot, const char *name)
+{
+    CHECK_OBJ_NOTNULL(snapshot, VARIABLES_SNAPSHOT_MAGIC);
+
+    if (snapshot->n == 0) {
+        return NULL;
+    }
+
+    const struct variables_snapshot_entry *result;
+    if (snapshot->seeds != NULL) {
+        uint64_t hash = hash_snapshot_name(name);
+        unsigned bucket = get_snapshot_bucket(hash, snapshot->n);
+        result = &snapshot->entries[
+            get_snapshot_slot(hash, snapshot->seeds[bucket], snapshot->n)];
+        if (result->hash != hash) {
+            return NULL;
+        }
+    } else {
+        unsigned i = lower_bound_snapshot(snapshot, name);
+        if (i == snapshot->n) {
+            return NULL;
+        }
+        result = &snapshot->entries[snapshot->sorted[i]];
+    }
+
+    return (strcmp(result->name, name) == 0) ? result : NULL;
+}
+
+unsigned
+is_set_snapshot_variable(
+    VRT_CTX, const variables_snapshot_t *snapshot, const char *name)
+{
+    AN(ctx->ws);
+    if (name != NULL) {
+        return find_snapshot_variable(snapshot, name) != NULL;
+    }
+    return 0;
+}
+
+const char *
+get_snapshot_variable(
+    VRT_CTX, const variables_snapshot_t *snapshot, const char *name,
+    const char *fallback)
+{
+    AN(ctx->ws);
+    const char *result = fallback;
+
+    if (name != NULL) {
+        const struct variables_snapshot_entry *entry =
+            find_snapshot_variable(snapshot, name);
+        if (entry != NULL) {
+            result = entry->value;
+        }
+    }
+
+    if (result != NULL) {
+        result = WS_Copy(ctx->ws, result, -1);
+        if (result == NULL) {
+            FAIL_WS(ctx, NULL);
+        }
+    }
+
+    return result;
+}
+
 /******************************************************************************
  * HELPERS.
  *****************************************************************************/
@@ -187,7 +734,6 @@ dump_variables(VRT_CTX, variables_t *variables, unsigned stream, const char *pre
 
     AN(ctx->ws);
     char *result, *end;
-    variable_t *variable;
     unsigned i = 0;
     unsigned free_ws = WS_ReserveAll(ctx->ws);
     if (free_ws <= 0) {
@@ -196,13 +742,19 @@ dump_variables(VRT_CTX, variables_t *variables, unsigned stream, const char *pre
     }
     result = end = WS_Reservation(ctx->ws);
 
+    // Only variables matching the prefix are visited, starting with the first
+    // one in lexical order.
+    variable_t lookup;
+    lookup.name = (prefix != NULL) ? prefix : "";
+    size_t len = strlen(lookup.name);
+
     DUMP_CHAR('{');
-    VRBT_FOREACH(variable, variables, variables) {
+    for (variable_t *variable = VRBT_NFIND(variables, variables, &lookup);
+         variable != NULL;
+         variable = VRBT_NEXT(variables, variables, variable)) {
         CHECK_OBJ_NOTNULL(variable, VARIABLE_MAGIC);
-        if (prefix != NULL &&
-            *prefix != '\0' &&
-            strncmp(variable->name, prefix, strlen(prefix)) != 0) {
-            continue;
+        if (strncmp(variable->name, lookup.name, len) != 0) {
+            break;
         }
         if (i > 0) {
             DUMP_CHAR(',');
@@ -220,5 +772,102 @@ dump_variables(VRT_CTX, variables_t *variables, unsigned stream, const char *pre
     return result;
 }
 
+// Only entries matching the prefix are visited (see prefix_range_snapshot()).
+const char *
+dump_snapshot_variables(
+    VRT_CTX, const variables_snapshot_t *snapshot, unsigned stream,
+    const char *prefix)
+{
+    CHECK_OBJ_NOTNULL(snapshot, VARIABLES_SNAPSHOT_MAGIC);
+
+    struct vsb *vsb = NULL;
+    if (stream && (
+        (ctx->method == VCL_MET_SYNTH) ||
+        (ctx->method == VCL_MET_BACKEND_ERROR))) {
+        CAST_OBJ_NOTNULL(vsb, ctx->specific, VSB_MAGIC);
+    }
+
+    AN(ctx->ws);
+    char *result, *end;
+    unsigned free_ws = WS_ReserveAll(ctx->ws);
+    if (free_ws <= 0) {
+        WS_Release(ctx->ws, 0);
+        FAIL_WS(ctx, NULL);
+    }
+    result = end = WS_Reservation(ctx->ws);
+
+    unsigned first, last;
+    prefix_range_snapshot(snapshot, prefix, &first, &last);
+
+    DUMP_CHAR('{');
+    for (unsigned j = first; j < last; j++) {
+        const struct variables_snapshot_entry *entry =
+            &snapshot->entries[snapshot->sorted[j]];
+        if (j > first) {
+            DUMP_CHAR(',');
+        }
+        DUMP_STRING(entry->name);
+        DUMP_CHAR(':');
+        DUMP_STRING(entry->value);
+    }
+    DUMP_CHAR('}');
+    *end = '\0';
+
+    WS_Release(ctx->ws, end - result + 1);
+
+    return result;
+}
+
+// JSON array with the names of the entries matching the prefix, in lexical
+// order.
+const char *
+list_snapshot_variables(
+    VRT_CTX, const variables_snapshot_t *snapshot, const char *prefix)
+{
+    CHECK_OBJ_NOTNULL(snapshot, VARIABLES_SNAPSHOT_MAGIC);
+
+    // Never streamed.
+    struct vsb *vsb = NULL;
+
+    AN(ctx->ws);
+    char *result, *end;
+    unsigned free_ws = WS_ReserveAll(ctx->ws);
+    if (free_ws <= 0) {
+        WS_Release(ctx->ws, 0);
+        FAIL_WS(ctx, NULL);
+    }
+    result = end = WS_Reservation(ctx->ws);
+
+    unsigned first, last;
+    prefix_range_snapshot(snapshot, prefix, &first, &last);
+
+    DUMP_CHAR('[');
+    for (unsigned j = first; j < last; j++) {
+        const struct variables_snapshot_entry *entry =
+            &snapshot->entries[snapshot->sorted[j]];
+        if (j > first) {
+            DUMP_CHAR(',');
+        }
+        DUMP_STRING(entry->name);
+    }
+    DUMP_CHAR(']');
+    *end = '\0';
+
+    WS_Release(ctx->ws, end - result + 1);
+
+    return result;
+}
+
 #undef DUMP_CHAR
 #undef DUMP_STRING
+
+unsigned
+count_snapshot_variables(
+    const variables_snapshot_t *snapshot, const char *prefix)
+{
+    CHECK_OBJ_NOTNULL(snapshot, VARIABLES_SNAPSHOT_MAGIC);
+
+    unsigned first, last;
+    prefix_range_snapshot(snapshot, prefix, &first, &last);
+    return last - first;
+}
@@ -17,13 +17,92 @@ typedef VRBT_HEAD(variables, variable) variables_t;
 
 VRBT_PROTOTYPE(variables, variable, tree, variablecmp);
 
+// Arena owning a tree of variables. Variables (including their names and
+// values) are bump allocated in chunks, so the whole tree is released at once
+// (i.e. a free() per chunk) instead of walking it. Variables removed from the
+// tree are not reused until the arena is released or compacted.
+struct variables_arena_chunk {
+    struct variables_arena_chunk *previous;
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(sizeof(void *))));
+};
+
+typedef struct variables_arena {
+    unsigned magic;
+    #define VARIABLES_ARENA_MAGIC 0x7a41e0c3
+
+    variables_t variables;
+
+    struct variables_arena_chunk *chunk;
+    // Bytes allocated in all chunks, including the ones of removed variables.
+    size_t used;
+} variables_arena_t;
+
+// Read-only snapshot of a set of variables, built once parsed and never
+// modified afterwards. Names and values are stored contiguously (in a single
+// allocation), indexed by a minimal perfect hash. 'sorted' keeps the entries
+// in lexical order. Snapshots are reference counted: the installed one holds
+// a reference, and so does every task pinning it.
+struct variables_snapshot_entry {
+    uint64_t hash;
+    const char *name;
+    const char *value;
+};
+
+typedef struct variables_snapshot {
+    unsigned magic;
+    #define VARIABLES_SNAPSHOT_MAGIC 0x5e1f93a4
+
+    // Atomically accessed.
+    unsigned refs;
+
+    unsigned n;
+    // Displacements of the buckets of the perfect hash (negative values are
+    // slots of single-entry buckets). NULL if building the perfect hash
+    // failed: entries are then sorted and looked up using a binary search.
+    int32_t *seeds;
+    struct variables_snapshot_entry *entries;
+    uint32_t *sorted;
+} variables_snapshot_t;
+
 variable_t *new_global_variable(const char *name, size_t len, const char *value);
 void free_global_variable(variable_t *variable);
 void flush_global_variables(variables_t *variables);
 
+variables_arena_t *new_variables_arena(size_t size);
+void free_variables_arena(variables_arena_t *arena);
+variables_arena_t *compact_variables_arena(variables_arena_t *arena);
+variable_t *new_arena_variable(
+    variables_arena_t *arena, const char *name, size_t len, const char *value);
+void set_arena_variable(
+    variables_arena_t *arena, variable_t *variable, const char *value);
+void append_arena_variable(
+    variables_arena_t *arena, variable_t *variable, const char *delimiter,
+    const char *value);
+
 variable_t *find_variable(variables_t *variables, const char *name);
 unsigned is_set_variable(VRT_CTX, variables_t *variables, const char *name);
 const char *get_variable(VRT_CTX, variables_t *variables, const char *name, const char *fallback);
 const char *dump_variables(VRT_CTX, variables_t *variables, unsigned stream, const char *prefix);
 
+variables_snapshot_t *new_variables_snapshot(variables_t *variables);
+void acquire_variables_snapshot(variables_snapshot_t *snapshot);
+void release_variables_snapshot(variables_snapshot_t *snapshot);
+
+const struct variables_snapshot_entry *find_snapshot_variable(
+    const variables_snapshot_t *snapshot, const char *name);
+unsigned is_set_snapshot_variable(
+    VRT_CTX, const variables_snapshot_t *snapshot, const char *name);
+const char *get_snapshot_variable(
+    VRT_CTX, const variables_snapshot_t *snapshot, const char *name,
+    const char *fallback);
+const char *dump_snapshot_variables(
+    VRT_CTX, const variables_snapshot_t *snapshot, unsigned stream,
+    const char *prefix);
+const char *list_snapshot_variables(
+    VRT_CTX, const variables_snapshot_t *snapshot, const char *prefix);
+unsigned count_snapshot_variables(
+    const variables_snapshot_t *snapshot, const char *prefix);
+
 #endif
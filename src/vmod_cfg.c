@@ -11,6 +11,8 @@
 #include "cache/cache.h"
 
 #include "helpers.h"
+#include "epochs.h"
+#include "remote.h"
 
 static void *
 dlreopen(void *addr)
@@ -35,16 +37,28 @@ vmod_event_function(VRT_CTX, struct vmod_priv *vcl_priv, enum vcl_event_e e)
                 vmod_state.locks.script = Lck_CreateClass(
                     &vmod_state.locks.vsc_seg, "cfg.script");
                 AN(vmod_state.locks.script);
+                init_epochs();
+                init_remotes(ctx);
             }
             vmod_state.refs++;
             break;
 
+        case VCL_EVENT_WARM:
+            warm_remotes(ctx);
+            break;
+
+        case VCL_EVENT_COLD:
+            cool_remotes(ctx);
+            break;
+
         case VCL_EVENT_DISCARD:
             assert(vmod_state.refs > 0);
             vmod_state.refs--;
             if (vmod_state.refs == 0) {
                 AZ(dlclose(vmod_state.libs.lua));
                 Lck_DestroyClass(&vmod_state.locks.vsc_seg);
+                fini_remotes(ctx);
+                fini_epochs();
             }
             break;
 
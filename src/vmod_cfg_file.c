@@ -3,159 +3,397 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <pthread.h>
 #include <math.h>
 #include <curl/curl.h>
 
 #include "cache/cache.h"
+#include "vsb.h"
 #include "vcc_cfg_if.h"
 
 #include "cJSON.h"
-#include "ini.h"
 
 #include "helpers.h"
+#include "epochs.h"
 #include "remote.h"
 #include "variables.h"
 
-struct vmod_cfg_file {
+// Remote and parsed contents of a file. Sources are shared by all objects
+// with identical definitions, no matter the VCL they belong to, so loading
+// several VCLs doesn't multiply fetches nor memory usage. See
+// 'vmod_state.files'.
+struct file_source {
     unsigned magic;
-    #define VMOD_CFG_FILE_MAGIC 0x9774a43f
+    #define FILE_SOURCE_MAGIC 0x1d8e40b7
 
+    // Name of the object that created the source. Only used for logging.
     const char *name;
 
+    // Protected by 'vmod_state.files.mutex'.
+    char *key;
+    unsigned refs;
+    VTAILQ_ENTRY(file_source) list;
+
     remote_t *remote;
+    VCL_ENUM format;
     const char *name_delimiter;
     const char *value_delimiter;
-    variables_t *(*parse)(VRT_CTX, struct vmod_cfg_file *, const char *, unsigned);
 
+    // Installed variables, as seen by VCL. Read without locks (see
+    // enter_epoch()) and replaced using publish_epoch_pointer().
     struct {
-        pthread_rwlock_t rwlock;
-        variables_t *variables;
+        variables_snapshot_t *snapshot;
     } state;
+
+    // Installed variables, only kept (i.e. not NULL) if patches may be
+    // applied to them. Only accessed while reloading the remote.
+    variables_arena_t *arena;
+
+    // Variables parsed from each file of glob locations during the last
+    // successful load, in lexical order. Only accessed while reloading the
+    // remote.
+    struct {
+        struct file_part *list;
+        unsigned n;
+    } parts;
 };
 
-struct file_parse_ctx {
-    struct vmod_cfg_file *file;
-    variables_t *variables;
+struct file_part {
+    const char *path;
+    variables_arena_t *arena;
 };
 
-/******************************************************************************
- * INI PARSER.
- *****************************************************************************/
+struct vmod_cfg_file {
+    unsigned magic;
+    #define VMOD_CFG_FILE_MAGIC 0x9774a43f
 
-struct file_ini_stream_ctx {
-    const char *ptr;
-    int left;
+    const char *name;
+    struct vcl *vcl;
+
+    struct file_source *source;
 };
 
-static char *
-file_ini_stream_reader(char *str, int size, void *stream)
+// Buffer reused to build flattened names while parsing a document, so no
+// allocations are needed for every variable.
+struct file_name {
+    char *ptr;
+    size_t len;
+    size_t size;
+};
+
+// Parsed variables are inserted in 'variables' and allocated in 'arena'
+// (usually owning 'variables').
+struct file_parse_ctx {
+    struct file_source *source;
+    variables_arena_t *arena;
+    variables_t *variables;
+    struct file_name name;
+};
+
+static void
+file_name_truncate(struct file_name *name, size_t len)
 {
-    struct file_ini_stream_ctx* ctx = (struct file_ini_stream_ctx*) stream;
+    assert(len <= name->len);
+    name->len = len;
+    if (name->ptr != NULL) {
+        name->ptr[len] = '\0';
+    }
+}
 
-    if (ctx->left <= 0) {
-        return NULL;
+static void
+file_name_cat(struct file_name *name, const char *value)
+{
+    size_t len = strlen(value);
+    if (name->len + len + 1 > name->size) {
+        name->size = 2 * (name->len + len + 1);
+        name->ptr = realloc(name->ptr, name->size);
+        AN(name->ptr);
     }
+    memcpy(name->ptr + name->len, value, len + 1);
+    name->len += len;
+}
 
-    int idx = 0;
-    char newline = '\0';
+static void
+file_name_free(struct file_name *name)
+{
+    free((void *) name->ptr);
+    name->ptr = NULL;
+    name->len = 0;
+    name->size = 0;
+}
 
-    for (idx = 0; idx < size - 1; ++idx) {
-        if (idx == ctx->left) {
-            break;
-        }
+static void
+file_acquire_snapshot(void *ptr)
+{
+    acquire_variables_snapshot(ptr);
+}
 
-        if (ctx->ptr[idx] == '\n') {
-            newline = '\n';
-            break;
-        } else if (ctx->ptr[idx] == '\r') {
-            newline = '\r';
-            break;
-        }
-    }
-    memcpy(str, ctx->ptr, idx);
-    str[idx] = '\0';
+static void
+file_release_snapshot(void *ptr)
+{
+    release_variables_snapshot(ptr);
+}
 
-    ctx->ptr += idx + 1;
-    ctx->left -= idx + 1;
-    if (newline && (ctx->left > 0) && (ctx->ptr[0] == newline)) {
-        ctx->left--;
-        ctx->ptr++;
+// Parsed variables are installed as a new read-only snapshot. They are then
+// released, unless patches may be applied to them.
+static void
+file_install(struct file_source *source, variables_arena_t *arena)
+{
+    publish_epoch_pointer(
+        (void **) &source->state.snapshot,
+        new_variables_snapshot(&arena->variables),
+        file_release_snapshot);
+
+    if (arena != source->arena) {
+        if (source->arena != NULL) {
+            free_variables_arena(source->arena);
+            source->arena = NULL;
+        }
+        if (source->remote->patch != NULL) {
+            source->arena = arena;
+        } else {
+            free_variables_arena(arena);
+        }
     }
-
-    return str;
 }
 
+/******************************************************************************
+ * INI PARSER.
+ *****************************************************************************/
+
 static int
 file_parse_ini_handler(void *c, const char *section, const char *name, const char *value)
 {
     struct file_parse_ctx *ctx = (struct file_parse_ctx *) c;
 
-    char *buffer;
-    unsigned flatten = (section != NULL) && (strlen(section) > 0);
-    assert(asprintf(
-        &buffer,
-        "%s%s%s",
-            flatten ? section : "",
-            flatten ? ctx->file->name_delimiter : "",
-            name) > 0);
+    file_name_truncate(&ctx->name, 0);
+    if ((section != NULL) && (strlen(section) > 0)) {
+        file_name_cat(&ctx->name, section);
+        file_name_cat(&ctx->name, ctx->source->name_delimiter);
+    }
+    file_name_cat(&ctx->name, name);
 
-    variable_t *variable = find_variable(ctx->variables, buffer);
+    variable_t *variable = find_variable(ctx->variables, ctx->name.ptr);
     if (variable == NULL) {
-        variable = new_global_variable(buffer, strlen(buffer), value);
+        variable = new_arena_variable(
+            ctx->arena, ctx->name.ptr, ctx->name.len, value);
         AZ(VRBT_INSERT(variables, ctx->variables, variable));
     } else {
-        variable->value = realloc(
-            variable->value,
-            strlen(variable->value) + strlen(ctx->file->value_delimiter) + strlen(value) + 1);
-        AN(variable->value);
-        if (strlen(variable->value) > 0) {
-            strcat(variable->value, ctx->file->value_delimiter);
-        }
-        strcat(variable->value, value);
+        append_arena_variable(
+            ctx->arena, variable, ctx->source->value_delimiter, value);
     }
 
-    free((void *) buffer);
-
     return 1;
 }
 
-static variables_t *
-file_parse_ini(VRT_CTX, struct vmod_cfg_file *file, const char *contents, unsigned is_backup)
+// Same limits used by inih: longer section names (and names of values
+// continued in following lines) are truncated.
+#define FILE_INI_MAX_SECTION 50
+#define FILE_INI_MAX_NAME 50
+#define FILE_INI_START_COMMENT_PREFIXES ";#"
+#define FILE_INI_INLINE_COMMENT_PREFIXES ";"
+
+struct file_ini_stream_ctx {
+    struct file_parse_ctx parse;
+    char section[FILE_INI_MAX_SECTION];
+    char prev_name[FILE_INI_MAX_NAME];
+    int lineno;
+    int error;
+};
+
+static char *
+file_ini_rstrip(char *s)
 {
-    variables_t *result = NULL;
+    char *p = s + strlen(s);
+    while ((p > s) && isspace((unsigned char) *--p)) {
+        *p = '\0';
+    }
+    return s;
+}
 
-    struct file_ini_stream_ctx file_ini_stream_ctx = {
-        .ptr = contents,
-        .left = strlen(contents)
-    };
+static char *
+file_ini_lskip(char *s)
+{
+    while ((*s != '\0') && isspace((unsigned char) *s)) {
+        s++;
+    }
+    return s;
+}
 
-    struct file_parse_ctx file_parse_ctx = {
-        .file = file,
-        .variables = malloc(sizeof(variables_t))
-    };
-    AN(file_parse_ctx.variables);
-    VRBT_INIT(file_parse_ctx.variables);
+static char *
+file_ini_find_chars_or_comment(char *s, const char *chars)
+{
+    // Inline comments must be prefixed by a whitespace character.
+    int was_space = 0;
+    while ((*s != '\0') &&
+           ((chars == NULL) || (strchr(chars, *s) == NULL)) &&
+           !(was_space && (strchr(FILE_INI_INLINE_COMMENT_PREFIXES, *s) != NULL))) {
+        was_space = isspace((unsigned char) *s);
+        s++;
+    }
+    return s;
+}
+
+static void
+file_ini_strncpy0(char *dst, const char *src, size_t size)
+{
+    strncpy(dst, src, size - 1);
+    dst[size - 1] = '\0';
+}
+
+static void *
+file_ini_stream_start(VRT_CTX, void *ptr)
+{
+    struct file_source *source;
+    CAST_OBJ_NOTNULL(source, ptr, FILE_SOURCE_MAGIC);
+
+    struct file_ini_stream_ctx *result = malloc(sizeof(struct file_ini_stream_ctx));
+    AN(result);
+    result->parse.source = source;
+    result->parse.arena = new_variables_arena(0);
+    result->parse.variables = &result->parse.arena->variables;
+    result->parse.name = (struct file_name) { NULL, 0, 0 };
+    result->section[0] = '\0';
+    result->prev_name[0] = '\0';
+    result->lineno = 0;
+    result->error = 0;
+
+    return result;
+}
+
+// Line-by-line equivalent of inih's ini_parse_stream(), allowing contents to
+// be parsed as they are read, and with no limits on the length of lines.
+static unsigned
+file_ini_stream_line(VRT_CTX, void *ptr, void *state, char *line)
+{
+    struct file_ini_stream_ctx *stream = (struct file_ini_stream_ctx *) state;
+    char *start, *end, *name, *value;
 
-    int rc = ini_parse_stream(
-        (ini_reader) file_ini_stream_reader, &file_ini_stream_ctx,
-        file_parse_ini_handler, &file_parse_ctx);
+    stream->lineno++;
 
-    if (rc == 0) {
-        result = file_parse_ctx.variables;
+    start = line;
+    if ((stream->lineno == 1) &&
+        ((unsigned char) start[0] == 0xEF) &&
+        ((unsigned char) start[1] == 0xBB) &&
+        ((unsigned char) start[2] == 0xBF)) {
+        start += 3;
+    }
+    start = file_ini_lskip(file_ini_rstrip(start));
+
+    if (strchr(FILE_INI_START_COMMENT_PREFIXES, *start) != NULL) {
+        // Start-of-line comment (or empty line).
+    } else if ((*stream->prev_name != '\0') && (start > line)) {
+        // Non-blank line with leading whitespace: continuation of the value
+        // of the previous name.
+        end = file_ini_find_chars_or_comment(start, NULL);
+        *end = '\0';
+        file_ini_rstrip(start);
+        file_parse_ini_handler(&stream->parse, stream->section, stream->prev_name, start);
+    } else if (*start == '[') {
+        end = file_ini_find_chars_or_comment(start + 1, "]");
+        if (*end == ']') {
+            *end = '\0';
+            file_ini_strncpy0(stream->section, start + 1, sizeof(stream->section));
+            *stream->prev_name = '\0';
+        } else {
+            stream->error = stream->lineno;
+        }
+    } else {
+        end = file_ini_find_chars_or_comment(start, "=:");
+        if ((*end == '=') || (*end == ':')) {
+            *end = '\0';
+            name = file_ini_rstrip(start);
+            value = end + 1;
+            end = file_ini_find_chars_or_comment(value, NULL);
+            *end = '\0';
+            value = file_ini_rstrip(file_ini_lskip(value));
+            file_ini_strncpy0(stream->prev_name, name, sizeof(stream->prev_name));
+            file_parse_ini_handler(&stream->parse, stream->section, name, value);
+        } else {
+            stream->error = stream->lineno;
+        }
+    }
+
+    return stream->error == 0;
+}
+
+static unsigned
+file_ini_stream_finish(
+    VRT_CTX, void *ptr, void *state, unsigned is_backup, unsigned commit)
+{
+    unsigned result = 0;
+
+    struct file_source *source;
+    CAST_OBJ_NOTNULL(source, ptr, FILE_SOURCE_MAGIC);
+    struct file_ini_stream_ctx *stream = (struct file_ini_stream_ctx *) state;
+
+    if (commit) {
+        AZ(stream->error);
 
         LOG(ctx, LOG_INFO,
             "Remote successfully parsed (file=%s, location=%s, is_backup=%d, format=ini)",
-            file->name, file->remote->location.raw, is_backup);
+            source->name, source->remote->location.raw, is_backup);
+
+        file_install(source, stream->parse.arena);
+        result = 1;
     } else {
-        flush_global_variables(file_parse_ctx.variables);
-        free((void *) file_parse_ctx.variables);
+        if (stream->error) {
+            LOG(ctx, LOG_ERR,
+                "Failed to parse remote (file=%s, location=%s, is_backup=%d, format=ini, error=%d)",
+                source->name, source->remote->location.raw, is_backup, stream->error);
+        }
 
-        LOG(ctx, LOG_ERR,
-            "Failed to parse remote (file=%s, location=%s, is_backup=%d, format=ini, error=%d)",
-            file->name, file->remote->location.raw, is_backup, rc);
+        free_variables_arena(stream->parse.arena);
     }
 
+    file_name_free(&stream->parse.name);
+    free((void *) stream);
+
+    return result;
+}
+
+static const remote_stream_t file_ini_stream = {
+    .start = file_ini_stream_start,
+    .line = file_ini_stream_line,
+    .finish = file_ini_stream_finish
+};
+
+// Parses complete contents using the stream parser. Returns NULL on errors,
+// setting 'error' to the offending line.
+static variables_arena_t *
+file_parse_ini(VRT_CTX, struct file_source *source, const char *contents, int *error)
+{
+    variables_arena_t *result = NULL;
+
+    struct file_ini_stream_ctx *stream = file_ini_stream_start(ctx, source);
+
+    char *buffer = strdup(contents);
+    AN(buffer);
+    char *line = buffer;
+    char *end;
+    do {
+        end = strchr(line, '\n');
+        if (end != NULL) {
+            *end = '\0';
+        }
+        if (!file_ini_stream_line(ctx, source, stream, line)) {
+            break;
+        }
+        line = end + 1;
+    } while ((end != NULL) && (*line != '\0'));
+    free((void *) buffer);
+
+    *error = stream->error;
+    if (stream->error == 0) {
+        result = stream->parse.arena;
+    } else {
+        free_variables_arena(stream->parse.arena);
+    }
+
+    file_name_free(&stream->parse.name);
+    free((void *) stream);
+
     return result;
 }
 
@@ -163,110 +401,784 @@ file_parse_ini(VRT_CTX, struct vmod_cfg_file *file, const char *contents, unsign
  * JSON PARSER.
  *****************************************************************************/
 
-static void
-file_parse_json_emit(struct file_parse_ctx *ctx, const char *prefix, cJSON *item)
-{
-    char *value = NULL;
+// Large enough for any number formatted by file_json_value().
+#define FILE_JSON_NUMBER_SIZE 512
 
+// Returns the value of scalar items, or NULL for any other item (i.e.
+// objects, arrays & nulls). Numbers are formatted in 'buffer' (at least
+// FILE_JSON_NUMBER_SIZE bytes).
+static const char *
+file_json_value(cJSON *item, char *buffer)
+{
     if (cJSON_IsFalse(item)) {
-        value = "false";
+        return "false";
     } else if (cJSON_IsTrue(item)) {
-        value = "true";
+        return "true";
     } else if (cJSON_IsNumber(item)) {
         double intpart;
+        int len;
         if (modf(item->valuedouble, &intpart) == 0) {
-            assert(asprintf(&value, "%d", item->valueint) > 0);
+            len = snprintf(buffer, FILE_JSON_NUMBER_SIZE, "%d", item->valueint);
         } else {
-            assert(asprintf(&value, "%.3f", item->valuedouble) > 0);
+            len = snprintf(buffer, FILE_JSON_NUMBER_SIZE, "%.3f", item->valuedouble);
         }
+        assert((len > 0) && (len < FILE_JSON_NUMBER_SIZE));
+        return buffer;
     } else if (cJSON_IsRaw(item) || cJSON_IsString(item)) {
-        value = item->valuestring;
+        return item->valuestring;
     }
 
-    if (value != NULL) {
-        char *name;
-        AN(item->string);
-        assert(asprintf(&name, "%s%s", prefix, item->string) > 0);
-
-        variable_t *variable = new_global_variable(name, strlen(name), value);
+    return NULL;
+}
 
-        free((void *) name);
-        if (cJSON_IsNumber(item)) {
-            free((void *) value);
-        }
+// 'ctx->name' contains the flattened name of the item.
+static void
+file_parse_json_emit(struct file_parse_ctx *ctx, cJSON *item)
+{
+    char buffer[FILE_JSON_NUMBER_SIZE];
+    const char *value = file_json_value(item, buffer);
 
+    if (value != NULL) {
+        variable_t *variable = new_arena_variable(
+            ctx->arena, ctx->name.ptr, ctx->name.len, value);
         AZ(VRBT_INSERT(variables, ctx->variables, variable));
     }
 }
 
+// 'ctx->name' contains the prefix of the items (i.e. the flattened name of
+// the object), which is restored before returning.
 static void
-file_parse_json_walk(struct file_parse_ctx *ctx, cJSON *items, const char *prefix)
+file_parse_json_walk(struct file_parse_ctx *ctx, cJSON *items)
 {
     assert(cJSON_IsObject(items));
 
+    size_t len = ctx->name.len;
     cJSON *item;
     cJSON_ArrayForEach(item, items) {
         AN(item->string);
 
+        file_name_cat(&ctx->name, item->string);
         if (cJSON_IsObject(item)) {
-            char *new_prefix;
-            assert(asprintf(
-                &new_prefix, "%s%s%s",
-                prefix,
-                item->string,
-                ctx->file->name_delimiter) >= 0);
-            file_parse_json_walk(ctx, item, new_prefix);
-            free((void *) new_prefix);
+            file_name_cat(&ctx->name, ctx->source->name_delimiter);
+            file_parse_json_walk(ctx, item);
         } else {
-            file_parse_json_emit(ctx, prefix, item);
+            file_parse_json_emit(ctx, item);
         }
+        file_name_truncate(&ctx->name, len);
     }
 }
 
-static variables_t *
-file_parse_json(VRT_CTX, struct vmod_cfg_file *file, const char *contents, unsigned is_backup)
+// Returns NULL on errors, setting 'type' to the type of the root item (or
+// to -1 if contents are not valid JSON).
+static variables_arena_t *
+file_parse_json_document(struct file_source *source, const char *contents, int *type)
+{
+    variables_arena_t *result = NULL;
+
+    const char *error;
+    cJSON *root = cJSON_ParseWithOpts(contents, &error, 0);
+
+    if (root != NULL) {
+        *type = root->type;
+        if (root->type == cJSON_Object) {
+            // Flattened names & values usually take about the same space as
+            // the document.
+            struct file_parse_ctx file_parse_ctx = {
+                .source = source,
+                .arena = new_variables_arena(strlen(contents)),
+                .name = { NULL, 0, 0 }
+            };
+            file_parse_ctx.variables = &file_parse_ctx.arena->variables;
+            file_parse_json_walk(&file_parse_ctx, root);
+            file_name_free(&file_parse_ctx.name);
+            result = file_parse_ctx.arena;
+        }
+
+        cJSON_Delete(root);
+    } else {
+        *type = -1;
+    }
+
+    return result;
+}
+
+static variables_arena_t *
+file_parse_json(VRT_CTX, struct file_source *source, const char *contents, unsigned is_backup)
+{
+    int type;
+    variables_arena_t *result = file_parse_json_document(source, contents, &type);
+
+    if (result != NULL) {
+        LOG(ctx, LOG_INFO,
+            "Remote successfully parsed (file=%s, location=%s, is_backup=%d, format=json)",
+            source->name, source->remote->location.raw, is_backup);
+    } else if (type >= 0) {
+        LOG(ctx, LOG_ERR,
+            "Unexpected JSON type (file=%s, location=%s, is_backup=%d, format=json, type=%d)",
+            source->name, source->remote->location.raw, is_backup, type);
+    } else {
+        LOG(ctx, LOG_ERR,
+            "Failed to parse remote (file=%s, location=%s, is_backup=%d, format=json)",
+            source->name, source->remote->location.raw, is_backup);
+    }
+
+    return result;
+}
+
+/******************************************************************************
+ * PATCHES.
+ *****************************************************************************/
+
+// Patches are applied in place to the kept variables (see 'arena' in
+// 'struct file_source'), so only the affected variables are touched, and a
+// new snapshot is then installed. Every change is recorded in a journal, so
+// patches failing halfway can be rolled back. New variables are allocated in
+// the arena of the kept variables, which is compacted once most of it is
+// used by removed ones.
+struct file_patch_change {
+    unsigned inserted;
+    variable_t *variable;
+};
+
+struct file_patch_ctx {
+    struct file_source *source;
+    variables_arena_t *arena;
+    variables_t *variables;
+    struct {
+        struct file_patch_change *list;
+        unsigned len;
+        unsigned size;
+    } journal;
+};
+
+static void
+file_patch_log(struct file_patch_ctx *ctx, unsigned inserted, variable_t *variable)
+{
+    if (ctx->journal.len == ctx->journal.size) {
+        ctx->journal.size = (ctx->journal.size > 0) ? ctx->journal.size * 2 : 16;
+        ctx->journal.list = realloc(
+            ctx->journal.list,
+            ctx->journal.size * sizeof(struct file_patch_change));
+        AN(ctx->journal.list);
+    }
+    ctx->journal.list[ctx->journal.len].inserted = inserted;
+    ctx->journal.list[ctx->journal.len].variable = variable;
+    ctx->journal.len++;
+}
+
+static void
+file_patch_insert(struct file_patch_ctx *ctx, variable_t *variable)
 {
-    variables_t *result = NULL;
+    AZ(VRBT_INSERT(variables, ctx->variables, variable));
+    file_patch_log(ctx, 1, variable);
+}
+
+static void
+file_patch_detach(struct file_patch_ctx *ctx, variable_t *variable)
+{
+    VRBT_REMOVE(variables, ctx->variables, variable);
+    file_patch_log(ctx, 0, variable);
+}
+
+// Prefix of the variables below 'name' (i.e. flattened children of an
+// object). The empty name is the root of the document.
+static char *
+file_patch_prefix(struct file_patch_ctx *ctx, const char *name)
+{
+    char *result;
+    assert(asprintf(
+        &result, "%s%s",
+        name,
+        (*name != '\0') ? ctx->source->name_delimiter : "") >= 0);
+    return result;
+}
+
+static variable_t *
+file_patch_first_child(variables_t *variables, const char *prefix)
+{
+    variable_t variable;
+    variable.name = prefix;
+    variable_t *result = VRBT_NFIND(variables, variables, &variable);
+    if ((result != NULL) &&
+        (strncmp(result->name, prefix, strlen(prefix)) == 0)) {
+        return result;
+    }
+    return NULL;
+}
+
+static variable_t *
+file_patch_leaf(struct file_patch_ctx *ctx, const char *name)
+{
+    return (*name != '\0') ? find_variable(ctx->variables, name) : NULL;
+}
+
+static unsigned
+file_patch_exists(struct file_patch_ctx *ctx, const char *name)
+{
+    char *prefix = file_patch_prefix(ctx, name);
+    unsigned result =
+        (file_patch_leaf(ctx, name) != NULL) ||
+        (file_patch_first_child(ctx->variables, prefix) != NULL);
+    free((void *) prefix);
+    return result;
+}
+
+// Removes the variable 'name' and, if 'children' is enabled, all variables
+// below it. Returns the number of removed variables.
+static unsigned
+file_patch_remove(struct file_patch_ctx *ctx, const char *name, unsigned children)
+{
+    unsigned result = 0;
+
+    variable_t *variable = file_patch_leaf(ctx, name);
+    if (variable != NULL) {
+        file_patch_detach(ctx, variable);
+        result++;
+    }
+
+    if (children) {
+        char *prefix = file_patch_prefix(ctx, name);
+        while ((variable = file_patch_first_child(ctx->variables, prefix)) != NULL) {
+            file_patch_detach(ctx, variable);
+            result++;
+        }
+        free((void *) prefix);
+    }
+
+    return result;
+}
+
+// Moves all variables in 'variables' (e.g. a flattened JSON object, allocated
+// in the arena of the installed ones) to the installed ones, releasing
+// 'variables'.
+static void
+file_patch_merge(struct file_patch_ctx *ctx, variables_t *variables)
+{
+    variable_t *variable, *variable_tmp;
+    VRBT_FOREACH_SAFE(variable, variables, variables, variable_tmp) {
+        CHECK_OBJ_NOTNULL(variable, VARIABLE_MAGIC);
+        VRBT_REMOVE(variables, variables, variable);
+        file_patch_insert(ctx, variable);
+    }
+    free((void *) variables);
+}
 
+// Flattens an object as if it were found at 'name' while parsing the whole
+// document.
+static variables_t *
+file_patch_flatten(struct file_patch_ctx *ctx, const char *name, cJSON *value)
+{
     struct file_parse_ctx file_parse_ctx = {
-        .file = file,
-        .variables = malloc(sizeof(variables_t))
+        .source = ctx->source,
+        .arena = ctx->arena,
+        .variables = malloc(sizeof(variables_t)),
+        .name = { NULL, 0, 0 }
     };
     AN(file_parse_ctx.variables);
     VRBT_INIT(file_parse_ctx.variables);
 
+    char *prefix = file_patch_prefix(ctx, name);
+    file_name_cat(&file_parse_ctx.name, prefix);
+    free((void *) prefix);
+    file_parse_json_walk(&file_parse_ctx, value);
+    file_name_free(&file_parse_ctx.name);
+
+    return file_parse_ctx.variables;
+}
+
+// Replaces 'name' (and everything below it) with 'value'. Arrays & nulls are
+// ignored by the parser, so in that case 'name' is simply removed.
+static unsigned
+file_patch_set(struct file_patch_ctx *ctx, const char *name, cJSON *value)
+{
+    if (cJSON_IsObject(value)) {
+        file_patch_remove(ctx, name, 1);
+        file_patch_merge(ctx, file_patch_flatten(ctx, name, value));
+    } else {
+        char buffer[FILE_JSON_NUMBER_SIZE];
+        const char *svalue = file_json_value(value, buffer);
+        if ((*name == '\0') && (svalue != NULL)) {
+            return 0;
+        }
+        file_patch_remove(ctx, name, 1);
+        if (svalue != NULL) {
+            file_patch_insert(
+                ctx, new_arena_variable(ctx->arena, name, strlen(name), svalue));
+        }
+    }
+    return 1;
+}
+
+static char *
+file_patch_child(struct file_patch_ctx *ctx, const char *name, const char *child)
+{
+    char *prefix = file_patch_prefix(ctx, name);
+    char *result;
+    assert(asprintf(&result, "%s%s", prefix, child) >= 0);
+    free((void *) prefix);
+    return result;
+}
+
+// JSON Merge Patch (RFC 7396). Returns 0 if the patch can't be applied
+// (e.g. a scalar for the empty name at the root of the document).
+static unsigned
+file_patch_merge_patch(struct file_patch_ctx *ctx, const char *name, cJSON *patch)
+{
+    assert(cJSON_IsObject(patch));
+
+    unsigned result = 1;
+    cJSON *item;
+    cJSON_ArrayForEach(item, patch) {
+        if (!result) {
+            break;
+        }
+        AN(item->string);
+        char *child = file_patch_child(ctx, name, item->string);
+        if (cJSON_IsObject(item)) {
+            file_patch_remove(ctx, child, 0);
+            result = file_patch_merge_patch(ctx, child, item);
+        } else if (cJSON_IsNull(item)) {
+            file_patch_remove(ctx, child, 1);
+        } else {
+            result = file_patch_set(ctx, child, item);
+        }
+        free((void *) child);
+    }
+
+    return result;
+}
+
+// Translates a JSON Pointer (RFC 6901) to the name of a flattened variable.
+// Returns NULL for invalid pointers.
+static char *
+file_patch_pointer(struct file_patch_ctx *ctx, const char *pointer)
+{
+    if ((*pointer != '\0') && (*pointer != '/')) {
+        return NULL;
+    }
+
+    struct vsb *vsb = VSB_new_auto();
+    AN(vsb);
+    unsigned valid = 1;
+    for (const char *ptr = pointer; (*ptr != '\0') && valid; ptr++) {
+        if (*ptr == '/') {
+            if (ptr > pointer) {
+                AZ(VSB_cat(vsb, ctx->source->name_delimiter));
+            }
+        } else if (*ptr == '~') {
+            ptr++;
+            if (*ptr == '0') {
+                AZ(VSB_putc(vsb, '~'));
+            } else if (*ptr == '1') {
+                AZ(VSB_putc(vsb, '/'));
+            } else {
+                valid = 0;
+            }
+        } else {
+            AZ(VSB_putc(vsb, *ptr));
+        }
+    }
+    AZ(VSB_finish(vsb));
+    char *result = valid ? strdup(VSB_data(vsb)) : NULL;
+    VSB_destroy(&vsb);
+
+    return result;
+}
+
+// Checks if the parent of the JSON Pointer 'pointer' exists and is an object
+// (i.e. the root of the document, or a name with flattened children). Empty
+// objects are not kept by the parser, so they are considered missing.
+static unsigned
+file_patch_parent_exists(struct file_patch_ctx *ctx, const char *pointer)
+{
+    const char *last = strrchr(pointer, '/');
+    if ((last == NULL) || (last == pointer)) {
+        return 1;
+    }
+
+    char *parent_pointer = strndup(pointer, last - pointer);
+    AN(parent_pointer);
+    char *parent = file_patch_pointer(ctx, parent_pointer);
+    free((void *) parent_pointer);
+
+    unsigned result = 0;
+    if (parent != NULL) {
+        char *prefix = file_patch_prefix(ctx, parent);
+        result =
+            (file_patch_leaf(ctx, parent) == NULL) &&
+            (file_patch_first_child(ctx->variables, prefix) != NULL);
+        free((void *) prefix);
+        free((void *) parent);
+    }
+
+    return result;
+}
+
+static unsigned
+file_patch_copy(struct file_patch_ctx *ctx, const char *from, const char *to, unsigned move)
+{
+    char *from_prefix = file_patch_prefix(ctx, from);
+    char *to_prefix = file_patch_prefix(ctx, to);
+    size_t from_prefix_len = strlen(from_prefix);
+    unsigned result = 0;
+
+    // Values can't be moved below themselves.
+    if (!move || (strncmp(to_prefix, from_prefix, from_prefix_len) != 0)) {
+        variables_t *variables = malloc(sizeof(variables_t));
+        AN(variables);
+        VRBT_INIT(variables);
+
+        variable_t *variable = file_patch_leaf(ctx, from);
+        if ((variable != NULL) && (*to != '\0')) {
+            AZ(VRBT_INSERT(variables, variables,
+                new_arena_variable(ctx->arena, to, strlen(to), variable->value)));
+            result = 1;
+        }
+        for (variable = file_patch_first_child(ctx->variables, from_prefix);
+             (variable != NULL) &&
+             (strncmp(variable->name, from_prefix, from_prefix_len) == 0);
+             variable = VRBT_NEXT(variables, ctx->variables, variable)) {
+            char *name;
+            assert(asprintf(
+                &name, "%s%s", to_prefix, variable->name + from_prefix_len) > 0);
+            AZ(VRBT_INSERT(variables, variables,
+                new_arena_variable(ctx->arena, name, strlen(name), variable->value)));
+            free((void *) name);
+            result = 1;
+        }
+
+        if (result) {
+            if (move) {
+                file_patch_remove(ctx, from, 1);
+            }
+            file_patch_remove(ctx, to, 1);
+            file_patch_merge(ctx, variables);
+        } else {
+            free((void *) variables);
+        }
+    }
+
+    free((void *) from_prefix);
+    free((void *) to_prefix);
+
+    return result;
+}
+
+static unsigned
+file_patch_test(struct file_patch_ctx *ctx, const char *name, cJSON *value)
+{
+    unsigned result = 0;
+    char *prefix = file_patch_prefix(ctx, name);
+    variable_t *leaf = file_patch_leaf(ctx, name);
+    variable_t *child = file_patch_first_child(ctx->variables, prefix);
+
+    if (cJSON_IsObject(value)) {
+        // Flattened children must be exactly the same.
+        if (leaf == NULL) {
+            variables_t *variables = file_patch_flatten(ctx, name, value);
+            variable_t *expected = VRBT_MIN(variables, variables);
+            result = 1;
+            while (result && ((expected != NULL) || (child != NULL))) {
+                result =
+                    (expected != NULL) &&
+                    (child != NULL) &&
+                    (strcmp(expected->name, child->name) == 0) &&
+                    (strcmp(expected->value, child->value) == 0);
+                if (result) {
+                    expected = VRBT_NEXT(variables, variables, expected);
+                    child = VRBT_NEXT(variables, ctx->variables, child);
+                    if ((child != NULL) &&
+                        (strncmp(child->name, prefix, strlen(prefix)) != 0)) {
+                        child = NULL;
+                    }
+                }
+            }
+            free((void *) variables);
+        }
+    } else {
+        char buffer[FILE_JSON_NUMBER_SIZE];
+        const char *svalue = file_json_value(value, buffer);
+        result =
+            (svalue != NULL) &&
+            (leaf != NULL) &&
+            (child == NULL) &&
+            (strcmp(leaf->value, svalue) == 0);
+    }
+
+    free((void *) prefix);
+
+    return result;
+}
+
+// JSON Patch (RFC 6902). Operations on arrays are not supported, since
+// arrays are ignored by the parser.
+static unsigned
+file_patch_json_patch(struct file_patch_ctx *ctx, cJSON *patch)
+{
+    unsigned result = cJSON_IsArray(patch);
+
+    cJSON *operation;
+    cJSON_ArrayForEach(operation, patch) {
+        if (!result) {
+            break;
+        }
+
+        cJSON *op = cJSON_GetObjectItemCaseSensitive(operation, "op");
+        cJSON *path = cJSON_GetObjectItemCaseSensitive(operation, "path");
+        cJSON *from = cJSON_GetObjectItemCaseSensitive(operation, "from");
+        cJSON *value = cJSON_GetObjectItemCaseSensitive(operation, "value");
+        char *name = cJSON_IsString(path) ?
+            file_patch_pointer(ctx, path->valuestring) : NULL;
+        char *from_name = cJSON_IsString(from) ?
+            file_patch_pointer(ctx, from->valuestring) : NULL;
+
+        if (!cJSON_IsString(op) || (name == NULL)) {
+            result = 0;
+        } else if (strcmp(op->valuestring, "add") == 0) {
+            result =
+                (value != NULL) &&
+                file_patch_parent_exists(ctx, path->valuestring) &&
+                file_patch_set(ctx, name, value);
+        } else if (strcmp(op->valuestring, "replace") == 0) {
+            result =
+                (value != NULL) &&
+                file_patch_parent_exists(ctx, path->valuestring) &&
+                file_patch_exists(ctx, name) &&
+                file_patch_set(ctx, name, value);
+        } else if (strcmp(op->valuestring, "remove") == 0) {
+            result = file_patch_remove(ctx, name, 1) > 0;
+        } else if (strcmp(op->valuestring, "move") == 0) {
+            result =
+                (from_name != NULL) &&
+                file_patch_copy(ctx, from_name, name, 1);
+        } else if (strcmp(op->valuestring, "copy") == 0) {
+            result =
+                (from_name != NULL) &&
+                file_patch_copy(ctx, from_name, name, 0);
+        } else if (strcmp(op->valuestring, "test") == 0) {
+            result =
+                (value != NULL) &&
+                file_patch_test(ctx, name, value);
+        } else {
+            result = 0;
+        }
+
+        free((void *) name);
+        free((void *) from_name);
+    }
+
+    return result;
+}
+
+// Removed variables are released along with the arena.
+static void
+file_patch_finish(struct file_patch_ctx *ctx, unsigned commit)
+{
+    if (!commit) {
+        for (unsigned i = ctx->journal.len; i > 0; i--) {
+            struct file_patch_change *change = &ctx->journal.list[i - 1];
+            if (change->inserted) {
+                VRBT_REMOVE(variables, ctx->variables, change->variable);
+            } else {
+                AZ(VRBT_INSERT(variables, ctx->variables, change->variable));
+            }
+        }
+    }
+
+    free((void *) ctx->journal.list);
+    ctx->journal.list = NULL;
+    ctx->journal.len = 0;
+    ctx->journal.size = 0;
+}
+
+static unsigned
+file_patch_callback(VRT_CTX, void *ptr, unsigned type, const char *contents)
+{
+    unsigned result = 0;
+
+    struct file_source *source;
+    CAST_OBJ_NOTNULL(source, ptr, FILE_SOURCE_MAGIC);
+
     const char *error;
     cJSON *root = cJSON_ParseWithOpts(contents, &error, 0);
 
     if (root != NULL) {
-        if (root->type == cJSON_Object) {
-            file_parse_json_walk(&file_parse_ctx, root, "");
+        struct file_patch_ctx file_patch_ctx = {
+            .source = source
+        };
+
+        // Failed patches are rolled back, and the remote is then fetched
+        // again completely.
+        if (source->arena != NULL) {
+            file_patch_ctx.arena = source->arena;
+            file_patch_ctx.variables = &source->arena->variables;
+            if (type == REMOTE_PATCH_MERGE) {
+                result =
+                    cJSON_IsObject(root) &&
+                    file_patch_merge_patch(&file_patch_ctx, "", root);
+            } else {
+                result = file_patch_json_patch(&file_patch_ctx, root);
+            }
+            file_patch_finish(&file_patch_ctx, result);
+            if (result) {
+                file_install(source, compact_variables_arena(source->arena));
+            }
+        }
+
+        cJSON_Delete(root);
+    }
 
-            result = file_parse_ctx.variables;
+    if (!result) {
+        LOG(ctx, LOG_ERR,
+            "Failed to apply patch (file=%s, location=%s, type=%s)",
+            source->name, source->remote->location.raw,
+            (type == REMOTE_PATCH_MERGE) ? "merge-patch" : "json-patch");
+    }
 
-            LOG(ctx, LOG_INFO,
-                "Remote successfully parsed (file=%s, location=%s, is_backup=%d, format=json)",
-                file->name, file->remote->location.raw, is_backup);
-        } else {
-            free((void *) file_parse_ctx.variables);
+    return result;
+}
+
+/******************************************************************************
+ * GLOB LOCATIONS.
+ *****************************************************************************/
+
+static variables_arena_t *
+file_parse_part(VRT_CTX, struct file_source *source, const remote_part_t *part)
+{
+    variables_arena_t *result;
 
+    if (source->format == enum_vmod_cfg_ini) {
+        int error;
+        result = file_parse_ini(ctx, source, part->contents, &error);
+        if (result == NULL) {
             LOG(ctx, LOG_ERR,
-                "Unexpected JSON type (file=%s, location=%s, is_backup=%d, format=json, type=%d)",
-                file->name, file->remote->location.raw, is_backup, root->type);
+                "Failed to parse file (file=%s, location=%s, path=%s, format=ini, error=%d)",
+                source->name, source->remote->location.raw, part->path, error);
         }
-
-        cJSON_Delete(root);
     } else {
-        free((void *) file_parse_ctx.variables);
+        int type;
+        result = file_parse_json_document(source, part->contents, &type);
+        if ((result == NULL) && (type >= 0)) {
+            LOG(ctx, LOG_ERR,
+                "Unexpected JSON type (file=%s, location=%s, path=%s, format=json, type=%d)",
+                source->name, source->remote->location.raw, part->path, type);
+        } else if (result == NULL) {
+            LOG(ctx, LOG_ERR,
+                "Failed to parse file (file=%s, location=%s, path=%s, format=json)",
+                source->name, source->remote->location.raw, part->path);
+        }
+    }
 
-        LOG(ctx, LOG_ERR,
-            "Failed to parse remote (file=%s, location=%s, is_backup=%d, format=json)",
-            file->name, file->remote->location.raw, is_backup);
+    return result;
+}
+
+static struct file_part *
+file_find_part(struct file_source *source, const char *path)
+{
+    for (unsigned i = 0; i < source->parts.n; i++) {
+        if (strcmp(source->parts.list[i].path, path) == 0) {
+            return &source->parts.list[i];
+        }
+    }
+    return NULL;
+}
+
+// Releases parts, except variables still used by any of the 'keep' ones.
+static void
+file_free_parts(
+    struct file_part *parts, unsigned nparts,
+    const struct file_part *keep, unsigned nkeep)
+{
+    for (unsigned i = 0; i < nparts; i++) {
+        unsigned kept = 0;
+        for (unsigned j = 0; (j < nkeep) && !kept; j++) {
+            kept = keep[j].arena == parts[i].arena;
+        }
+        if (!kept && (parts[i].arena != NULL)) {
+            free_variables_arena(parts[i].arena);
+        }
+        free((void *) parts[i].path);
+    }
+    free((void *) parts);
+}
+
+// Variables of later files override the ones of previous files.
+static variables_arena_t *
+file_merge_parts(struct file_part *parts, unsigned nparts)
+{
+    size_t size = 0;
+    for (unsigned i = 0; i < nparts; i++) {
+        size += parts[i].arena->used;
+    }
+
+    variables_arena_t *result = new_variables_arena(size);
+
+    for (unsigned i = 0; i < nparts; i++) {
+        variable_t *ivariable;
+        VRBT_FOREACH(ivariable, variables, &parts[i].arena->variables) {
+            CHECK_OBJ_NOTNULL(ivariable, VARIABLE_MAGIC);
+            variable_t *variable = find_variable(
+                &result->variables, ivariable->name);
+            if (variable == NULL) {
+                variable = new_arena_variable(
+                    result, ivariable->name, strlen(ivariable->name),
+                    ivariable->value);
+                AZ(VRBT_INSERT(variables, &result->variables, variable));
+            } else {
+                set_arena_variable(result, variable, ivariable->value);
+            }
+        }
     }
 
     return result;
 }
 
+// Only new or changed files are parsed. Variables of unchanged files are
+// reused from the previous load, and then all of them are merged into the
+// snapshot to be installed.
+static unsigned
+file_parts_callback(VRT_CTX, void *ptr, const remote_part_t *parts, unsigned nparts)
+{
+    struct file_source *source;
+    CAST_OBJ_NOTNULL(source, ptr, FILE_SOURCE_MAGIC);
+
+    struct file_part *result = calloc(nparts, sizeof(struct file_part));
+    AN(result);
+    unsigned nparsed = 0;
+    unsigned failed = 0;
+
+    for (unsigned i = 0; (i < nparts) && !failed; i++) {
+        result[i].path = strdup(parts[i].path);
+        AN(result[i].path);
+        struct file_part *old = parts[i].changed ?
+            NULL : file_find_part(source, parts[i].path);
+        if (old != NULL) {
+            result[i].arena = old->arena;
+        } else {
+            result[i].arena = file_parse_part(ctx, source, &parts[i]);
+            failed = result[i].arena == NULL;
+            nparsed++;
+        }
+    }
+
+    if (failed) {
+        file_free_parts(result, nparts, source->parts.list, source->parts.n);
+        return 0;
+    }
+
+    file_install(source, file_merge_parts(result, nparts));
+    file_free_parts(source->parts.list, source->parts.n, result, nparts);
+    source->parts.list = result;
+    source->parts.n = nparts;
+
+    LOG(ctx, LOG_INFO,
+        "Remote successfully parsed (file=%s, location=%s, files=%u, parsed=%u, format=%s)",
+        source->name, source->remote->location.raw, nparts, nparsed,
+        source->format);
+
+    return 1;
+}
+
 /******************************************************************************
  * BASICS.
  *****************************************************************************/
@@ -276,19 +1188,12 @@ file_check_callback(VRT_CTX, void *ptr, char *contents, unsigned is_backup)
 {
     unsigned result = 0;
 
-    struct vmod_cfg_file *file;
-    CAST_OBJ_NOTNULL(file, ptr, VMOD_CFG_FILE_MAGIC);
-
-    variables_t *variables = (*file->parse)(ctx, file, contents, is_backup);
-    if (variables != NULL) {
-        AZ(pthread_rwlock_wrlock(&file->state.rwlock));
-        variables_t *old = file->state.variables;
-        file->state.variables = variables;
-        AZ(pthread_rwlock_unlock(&file->state.rwlock));
-
-        flush_global_variables(old);
-        free((void *) old);
+    struct file_source *source;
+    CAST_OBJ_NOTNULL(source, ptr, FILE_SOURCE_MAGIC);
 
+    variables_arena_t *arena = file_parse_json(ctx, source, contents, is_backup);
+    if (arena != NULL) {
+        file_install(source, arena);
         result = 1;
     }
 
@@ -298,23 +1203,203 @@ file_check_callback(VRT_CTX, void *ptr, char *contents, unsigned is_backup)
 static unsigned
 file_check(VRT_CTX, struct vmod_cfg_file *file, unsigned force_load, unsigned force_backup)
 {
-    return check_remote(ctx, file->remote, force_load, force_backup, &file_check_callback, file);
+    return check_remote(ctx, file->source->remote, force_load, force_backup);
+}
+
+// Must be called between enter_epoch() and leave_epoch().
+static const variables_snapshot_t *
+file_get_snapshot(struct vmod_cfg_file *file)
+{
+    return get_epoch_pointer((void **) &file->source->state.snapshot);
+}
+
+// See pin_epoch_pointer().
+static const variables_snapshot_t *
+file_pin_snapshot(VRT_CTX, struct vmod_cfg_file *file, unsigned refresh)
+{
+    return pin_epoch_pointer(
+        ctx, file, (void **) &file->source->state.snapshot,
+        file_acquire_snapshot, file_release_snapshot, refresh);
+}
+
+#define KEY_STRING(value) \
+    do { \
+        const char *_value = ((value) != NULL) ? (value) : ""; \
+        AZ(VSB_printf(vsb, "%zu:%s;", strlen(_value), _value)); \
+    } while (0)
+
+#define KEY_NUMBER(value) \
+    AZ(VSB_printf(vsb, "%jd;", (intmax_t) (value)))
+
+// Sources are shared by objects whose definitions only differ in their names
+// or in arguments affecting their initial loading (i.e. 'ignore_load_failures'
+// and 'warm_start').
+static char *
+file_key(
+    VCL_STRING location, VCL_STRING backup, VCL_BOOL automated_backups,
+    VCL_INT period, VCL_BOOL keep_contents, VCL_INT curl_connection_timeout,
+    VCL_INT curl_transfer_timeout, VCL_BOOL curl_ssl_verify_peer,
+    VCL_BOOL curl_ssl_verify_host, VCL_STRING curl_ssl_cafile,
+    VCL_STRING curl_ssl_capath, VCL_STRING curl_proxy, VCL_BOOL curl_http2,
+    VCL_BOOL curl_compression, VCL_INT curl_max_body_size,
+    VCL_INT curl_watch_timeout, VCL_INT curl_hedge_delay,
+    VCL_BOOL curl_delta_updates, VCL_ENUM format,
+    VCL_STRING name_delimiter, VCL_STRING value_delimiter)
+{
+    struct vsb *vsb = VSB_new_auto();
+    AN(vsb);
+
+    KEY_STRING(location);
+    KEY_STRING(backup);
+    KEY_NUMBER(automated_backups);
+    KEY_NUMBER(period);
+    KEY_NUMBER(keep_contents);
+    KEY_NUMBER(curl_connection_timeout);
+    KEY_NUMBER(curl_transfer_timeout);
+    KEY_NUMBER(curl_ssl_verify_peer);
+    KEY_NUMBER(curl_ssl_verify_host);
+    KEY_STRING(curl_ssl_cafile);
+    KEY_STRING(curl_ssl_capath);
+    KEY_STRING(curl_proxy);
+    KEY_NUMBER(curl_http2);
+    KEY_NUMBER(curl_compression);
+    KEY_NUMBER(curl_max_body_size);
+    KEY_NUMBER(curl_watch_timeout);
+    KEY_NUMBER(curl_hedge_delay);
+    KEY_NUMBER(curl_delta_updates);
+    KEY_STRING(format);
+    KEY_STRING(name_delimiter);
+    KEY_STRING(value_delimiter);
+
+    AZ(VSB_finish(vsb));
+    char *result = strdup(VSB_data(vsb));
+    AN(result);
+    VSB_destroy(&vsb);
+
+    return result;
+}
+
+#undef KEY_STRING
+#undef KEY_NUMBER
+
+// Returns the source matching the key with an extra reference, if any. Must
+// be called while holding 'vmod_state.files.mutex'.
+static struct file_source *
+file_find_source(const char *key)
+{
+    struct file_source *isource;
+    VTAILQ_FOREACH(isource, &vmod_state.files.list, list) {
+        CHECK_OBJ_NOTNULL(isource, FILE_SOURCE_MAGIC);
+        if (strcmp(isource->key, key) == 0) {
+            isource->refs++;
+            return isource;
+        }
+    }
+    return NULL;
 }
 
 #define SET_STRING(value, field) \
     do { \
-        instance->field = strdup(value); \
-        AN(instance->field); \
+        source->field = strdup(value); \
+        AN(source->field); \
+    } while (0)
+
+static struct file_source *
+file_new_source(
+    VRT_CTX, const char *vcl_name, char *key,
+    VCL_STRING location, VCL_STRING backup, VCL_BOOL automated_backups,
+    VCL_INT period, VCL_BOOL keep_contents, VCL_INT curl_connection_timeout,
+    VCL_INT curl_transfer_timeout, VCL_BOOL curl_ssl_verify_peer,
+    VCL_BOOL curl_ssl_verify_host, VCL_STRING curl_ssl_cafile,
+    VCL_STRING curl_ssl_capath, VCL_STRING curl_proxy, VCL_BOOL curl_http2,
+    VCL_BOOL curl_compression, VCL_INT curl_max_body_size,
+    VCL_INT curl_watch_timeout, VCL_INT curl_hedge_delay,
+    VCL_BOOL curl_delta_updates, VCL_ENUM format,
+    VCL_STRING name_delimiter, VCL_STRING value_delimiter)
+{
+    struct file_source *source;
+    ALLOC_OBJ(source, FILE_SOURCE_MAGIC);
+    AN(source);
+
+    SET_STRING(vcl_name, name);
+    source->key = key;
+    source->refs = 1;
+    source->remote = new_remote(
+        ctx, location, backup, automated_backups,
+        period, keep_contents, curl_connection_timeout, curl_transfer_timeout,
+        curl_ssl_verify_peer, curl_ssl_verify_host, curl_ssl_cafile,
+        curl_ssl_capath, curl_proxy, curl_http2, curl_compression,
+        curl_max_body_size, curl_watch_timeout, curl_hedge_delay,
+        &file_check_callback,
+        (format == enum_vmod_cfg_ini) ? &file_ini_stream : NULL,
+        &file_parts_callback,
+        (curl_delta_updates && (format == enum_vmod_cfg_json)) ?
+            &file_patch_callback : NULL,
+        source);
+    source->format = format;
+    SET_STRING(name_delimiter, name_delimiter);
+    SET_STRING(value_delimiter, value_delimiter);
+    source->state.snapshot = new_variables_snapshot(NULL);
+    if (source->remote->patch != NULL) {
+        source->arena = new_variables_arena(0);
+    } else {
+        source->arena = NULL;
+    }
+    source->parts.list = NULL;
+    source->parts.n = 0;
+
+    return source;
+}
+
+#undef SET_STRING
+
+#define FREE_STRING(field) \
+    do { \
+        free((void *) source->field); \
+        source->field = NULL; \
     } while (0)
 
+static void
+file_free_source(struct file_source *source)
+{
+    CHECK_OBJ_NOTNULL(source, FILE_SOURCE_MAGIC);
+    AZ(source->refs);
+
+    // The remote may be still logging the name of the source (e.g. during the
+    // initial loading), so it must be released first.
+    free_remote(source->remote);
+    source->remote = NULL;
+    FREE_STRING(name);
+    FREE_STRING(key);
+    FREE_STRING(name_delimiter);
+    FREE_STRING(value_delimiter);
+    release_variables_snapshot(source->state.snapshot);
+    source->state.snapshot = NULL;
+    if (source->arena != NULL) {
+        free_variables_arena(source->arena);
+        source->arena = NULL;
+    }
+    file_free_parts(source->parts.list, source->parts.n, NULL, 0);
+    source->parts.list = NULL;
+    source->parts.n = 0;
+
+    FREE_OBJ(source);
+}
+
+#undef FREE_STRING
+
 VCL_VOID
 vmod_file__init(
     VRT_CTX, struct vmod_cfg_file **file, const char *vcl_name,
     VCL_STRING location, VCL_STRING backup, VCL_BOOL automated_backups, VCL_INT period,
-    VCL_BOOL ignore_load_failures, VCL_INT curl_connection_timeout,
+    VCL_BOOL ignore_load_failures, VCL_BOOL warm_start, VCL_BOOL keep_contents,
+    VCL_INT curl_connection_timeout,
     VCL_INT curl_transfer_timeout, VCL_BOOL curl_ssl_verify_peer,
     VCL_BOOL curl_ssl_verify_host, VCL_STRING curl_ssl_cafile,
-    VCL_STRING curl_ssl_capath, VCL_STRING curl_proxy, VCL_ENUM format,
+    VCL_STRING curl_ssl_capath, VCL_STRING curl_proxy, VCL_BOOL curl_http2,
+    VCL_BOOL curl_compression, VCL_INT curl_max_body_size,
+    VCL_INT curl_watch_timeout, VCL_INT curl_hedge_delay,
+    VCL_BOOL curl_delta_updates, VCL_ENUM format,
     VCL_STRING name_delimiter, VCL_STRING value_delimiter)
 {
     CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
@@ -324,9 +1409,13 @@ vmod_file__init(
     struct vmod_cfg_file *instance = NULL;
 
     if ((location != NULL) && (strlen(location) > 0) &&
+        is_valid_location(ctx, location) &&
         (period >= 0) &&
         (curl_connection_timeout >= 0) &&
         (curl_transfer_timeout >= 0) &&
+        (curl_max_body_size >= 0) &&
+        (curl_watch_timeout >= 0) &&
+        (curl_hedge_delay >= 0) &&
         (name_delimiter != NULL) &&
         (value_delimiter != NULL)) {
         ALLOC_OBJ(instance, VMOD_CFG_FILE_MAGIC);
@@ -334,27 +1423,48 @@ vmod_file__init(
 
         instance->name = strdup(vcl_name);
         AN(instance->name);
-        instance->remote = new_remote(
-            location, backup, automated_backups,
-            period, curl_connection_timeout, curl_transfer_timeout,
+        instance->vcl = ctx->vcl;
+
+        char *key = file_key(
+            location, backup, automated_backups, period, keep_contents,
+            curl_connection_timeout, curl_transfer_timeout,
             curl_ssl_verify_peer, curl_ssl_verify_host, curl_ssl_cafile,
-            curl_ssl_capath, curl_proxy);
-        SET_STRING(name_delimiter, name_delimiter);
-        SET_STRING(value_delimiter, value_delimiter);
-        if (format == enum_vmod_cfg_ini) {
-            instance->parse = &file_parse_ini;
-        } else if (format == enum_vmod_cfg_json) {
-            instance->parse = &file_parse_json;
+            curl_ssl_capath, curl_proxy, curl_http2, curl_compression,
+            curl_max_body_size, curl_watch_timeout, curl_hedge_delay,
+            curl_delta_updates,
+            format, name_delimiter, value_delimiter);
+
+        AZ(pthread_mutex_lock(&vmod_state.files.mutex));
+        instance->source = file_find_source(key);
+        unsigned shared = instance->source != NULL;
+        if (shared) {
+            free((void *) key);
         } else {
-            WRONG("Illegal format value.");
+            instance->source = file_new_source(
+                ctx, vcl_name, key, location, backup, automated_backups,
+                period, keep_contents, curl_connection_timeout, curl_transfer_timeout,
+                curl_ssl_verify_peer, curl_ssl_verify_host, curl_ssl_cafile,
+                curl_ssl_capath, curl_proxy, curl_http2, curl_compression,
+                curl_max_body_size, curl_watch_timeout, curl_hedge_delay,
+                curl_delta_updates,
+                format, name_delimiter, value_delimiter);
+            VTAILQ_INSERT_TAIL(&vmod_state.files.list, instance->source, list);
         }
-        AZ(pthread_rwlock_init(&instance->state.rwlock, NULL));
-        instance->state.variables = malloc(sizeof(variables_t));
-        AN(instance->state.variables);
-        VRBT_INIT(instance->state.variables);
+        AZ(pthread_mutex_unlock(&vmod_state.files.mutex));
 
-        if (!file_check(ctx, instance, 1, 0) && !ignore_load_failures) {
-            vmod_file__fini(&instance);
+        // Shared sources already loaded by other objects are used as they
+        // are (i.e. no I/O at all). Otherwise, the usual initial loading is
+        // executed.
+        if (shared) {
+            share_remote(ctx, instance->source->remote);
+        }
+        if (!file_check(ctx, instance, 0, 0) &&
+            !(warm_start && warm_start_remote(ctx, instance->source->remote))) {
+            if (ignore_load_failures) {
+                load_remote(ctx, instance->source->remote);
+            } else if (!file_check(ctx, instance, 1, 0)) {
+                vmod_file__fini(&instance);
+            }
         }
     }
 
@@ -365,14 +1475,6 @@ vmod_file__init(
     *file = instance;
 }
 
-#undef SET_STRING
-
-#define FREE_STRING(field) \
-    do { \
-        free((void *) instance->field); \
-        instance->field = NULL; \
-    } while (0)
-
 VCL_VOID
 vmod_file__fini(struct vmod_cfg_file **file)
 {
@@ -382,55 +1484,122 @@ vmod_file__fini(struct vmod_cfg_file **file)
     struct vmod_cfg_file *instance = *file;
     CHECK_OBJ_NOTNULL(instance, VMOD_CFG_FILE_MAGIC);
 
+    struct file_source *source = instance->source;
+    CHECK_OBJ_NOTNULL(source, FILE_SOURCE_MAGIC);
+
+    AZ(pthread_mutex_lock(&vmod_state.files.mutex));
+    assert(source->refs > 0);
+    unsigned last = --source->refs == 0;
+    if (last) {
+        VTAILQ_REMOVE(&vmod_state.files.list, source, list);
+    }
+    AZ(pthread_mutex_unlock(&vmod_state.files.mutex));
+
+    if (last) {
+        file_free_source(source);
+    } else {
+        unshare_remote(source->remote, instance->vcl);
+    }
+    instance->source = NULL;
     free((void *) instance->name);
     instance->name = NULL;
-    free_remote(instance->remote);
-    instance->remote = NULL;
-    FREE_STRING(name_delimiter);
-    FREE_STRING(value_delimiter);
-    instance->parse = NULL;
-    AZ(pthread_rwlock_destroy(&instance->state.rwlock));
-    flush_global_variables(instance->state.variables);
-    free((void *) instance->state.variables);
-    instance->state.variables = NULL;
+    instance->vcl = NULL;
 
     FREE_OBJ(instance);
 
     *file = NULL;
 }
 
-#undef FREE_STRING
-
+// Tasks explicitly reloading or updating the file see the new variables in
+// subsequent reads.
 VCL_BOOL
 vmod_file_reload(VRT_CTX, struct vmod_cfg_file *file, VCL_BOOL force_backup)
 {
-    return file_check(ctx, file, 1, force_backup);
+    unsigned result = file_check(ctx, file, 1, force_backup);
+    file_pin_snapshot(ctx, file, 1);
+    return result;
+}
+
+VCL_BOOL
+vmod_file_update(VRT_CTX, struct vmod_cfg_file *file, VCL_BOOL force_backup)
+{
+    unsigned result = update_remote(ctx, file->source->remote, force_backup);
+    file_pin_snapshot(ctx, file, 1);
+    return result;
 }
 
 VCL_STRING
 vmod_file_dump(VRT_CTX, struct vmod_cfg_file *file, VCL_BOOL stream, VCL_STRING prefix)
 {
     file_check(ctx, file, 0, 0);
-    AZ(pthread_rwlock_rdlock(&file->state.rwlock));
-    const char *result = dump_variables(ctx, file->state.variables, stream, prefix);
-    AZ(pthread_rwlock_unlock(&file->state.rwlock));
+    const variables_snapshot_t *snapshot = file_pin_snapshot(ctx, file, 0);
+    if (snapshot != NULL) {
+        return dump_snapshot_variables(ctx, snapshot, stream, prefix);
+    }
+
+    epoch_reader_t *reader = enter_epoch();
+    const char *result = dump_snapshot_variables(
+        ctx, file_get_snapshot(file), stream, prefix);
+    leave_epoch(reader);
+    return result;
+}
+
+VCL_STRING
+vmod_file_list(VRT_CTX, struct vmod_cfg_file *file, VCL_STRING prefix)
+{
+    file_check(ctx, file, 0, 0);
+    const variables_snapshot_t *snapshot = file_pin_snapshot(ctx, file, 0);
+    if (snapshot != NULL) {
+        return list_snapshot_variables(ctx, snapshot, prefix);
+    }
+
+    epoch_reader_t *reader = enter_epoch();
+    const char *result = list_snapshot_variables(
+        ctx, file_get_snapshot(file), prefix);
+    leave_epoch(reader);
+    return result;
+}
+
+VCL_INT
+vmod_file_count(VRT_CTX, struct vmod_cfg_file *file, VCL_STRING prefix)
+{
+    file_check(ctx, file, 0, 0);
+    const variables_snapshot_t *snapshot = file_pin_snapshot(ctx, file, 0);
+    if (snapshot != NULL) {
+        return count_snapshot_variables(snapshot, prefix);
+    }
+
+    epoch_reader_t *reader = enter_epoch();
+    unsigned result = count_snapshot_variables(file_get_snapshot(file), prefix);
+    leave_epoch(reader);
     return result;
 }
 
 VCL_VOID
 vmod_file_inspect(VRT_CTX, struct vmod_cfg_file *file)
 {
-    file_check(ctx, file, 0, 0);
-    inspect_remote(ctx, file->remote);
+    unsigned loaded = file_check(ctx, file, 0, 0);
+    if (!inspect_remote(ctx, file->source->remote) && loaded) {
+        // Raw contents are not available: dump installed variables instead.
+        epoch_reader_t *reader = enter_epoch();
+        dump_snapshot_variables(ctx, file_get_snapshot(file), 1, NULL);
+        leave_epoch(reader);
+    }
 }
 
 VCL_BOOL
 vmod_file_is_set(VRT_CTX, struct vmod_cfg_file *file, VCL_STRING name)
 {
     file_check(ctx, file, 0, 0);
-    AZ(pthread_rwlock_rdlock(&file->state.rwlock));
-    unsigned result = is_set_variable(ctx, file->state.variables, name);
-    AZ(pthread_rwlock_unlock(&file->state.rwlock));
+    const variables_snapshot_t *snapshot = file_pin_snapshot(ctx, file, 0);
+    if (snapshot != NULL) {
+        return is_set_snapshot_variable(ctx, snapshot, name);
+    }
+
+    epoch_reader_t *reader = enter_epoch();
+    unsigned result = is_set_snapshot_variable(
+        ctx, file_get_snapshot(file), name);
+    leave_epoch(reader);
     return result;
 }
 
@@ -438,8 +1607,32 @@ VCL_STRING
 vmod_file_get(VRT_CTX, struct vmod_cfg_file *file, VCL_STRING name, VCL_STRING fallback)
 {
     file_check(ctx, file, 0, 0);
-    AZ(pthread_rwlock_rdlock(&file->state.rwlock));
-    const char *result = get_variable(ctx, file->state.variables, name, fallback);
-    AZ(pthread_rwlock_unlock(&file->state.rwlock));
+    const variables_snapshot_t *snapshot = file_pin_snapshot(ctx, file, 0);
+    if (snapshot != NULL) {
+        // No need to copy the value: the snapshot is pinned until the end of
+        // the task.
+        const struct variables_snapshot_entry *entry = (name != NULL) ?
+            find_snapshot_variable(snapshot, name) : NULL;
+        return (entry != NULL) ? entry->value : fallback;
+    }
+
+    epoch_reader_t *reader = enter_epoch();
+    const char *result = get_snapshot_variable(
+        ctx, file_get_snapshot(file), name, fallback);
+    leave_epoch(reader);
     return result;
 }
+
+VCL_INT
+vmod_file_counter(VRT_CTX, struct vmod_cfg_file *file, VCL_STRING name)
+{
+    uint64_t value;
+    if (get_remote_counter(file->source->remote, name, &value)) {
+        return value;
+    } else {
+        LOG(ctx, LOG_ERR,
+            "Failed to fetch counter (file=%s, name=%s)",
+            file->name, name);
+        return 0;
+    }
+}
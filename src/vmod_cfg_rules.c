@@ -11,6 +11,7 @@
 #include "vcc_cfg_if.h"
 
 #include "helpers.h"
+#include "epochs.h"
 #include "remote.h"
 
 typedef struct rule {
@@ -23,7 +24,17 @@ typedef struct rule {
     VTAILQ_ENTRY(rule) list;
 } rule_t;
 
-typedef VTAILQ_HEAD(rules, rule) rules_t;
+// Reference counted: the installed rules hold a reference, and so does every
+// task pinning them.
+typedef struct rules {
+    unsigned magic;
+    #define RULES_MAGIC 0x3d0a6e95
+
+    // Atomically accessed.
+    unsigned refs;
+
+    VTAILQ_HEAD(, rule) list;
+} rules_t;
 
 struct vmod_cfg_rules {
     unsigned magic;
@@ -33,8 +44,9 @@ struct vmod_cfg_rules {
 
     remote_t *remote;
 
+    // Read without locks (see enter_epoch()) and replaced using
+    // publish_epoch_pointer().
     struct {
-        pthread_rwlock_t rwlock;
         rules_t *rules;
     } state;
 };
@@ -72,168 +84,220 @@ free_rule(rule_t *rule)
     FREE_OBJ(rule);
 }
 
+static rules_t *
+new_rules()
+{
+    rules_t *result;
+    ALLOC_OBJ(result, RULES_MAGIC);
+    AN(result);
+
+    result->refs = 1;
+    VTAILQ_INIT(&result->list);
+
+    return result;
+}
+
 static void
-flush_rules(rules_t *rules)
+free_rules(rules_t *rules)
 {
+    CHECK_OBJ_NOTNULL(rules, RULES_MAGIC);
+
     rule_t *irule;
-    while (!VTAILQ_EMPTY(rules)) {
-        irule = VTAILQ_FIRST(rules);
+    while (!VTAILQ_EMPTY(&rules->list)) {
+        irule = VTAILQ_FIRST(&rules->list);
         CHECK_OBJ_NOTNULL(irule, RULE_MAGIC);
-        VTAILQ_REMOVE(rules, irule, list);
+        VTAILQ_REMOVE(&rules->list, irule, list);
         free_rule(irule);
     }
+
+    FREE_OBJ(rules);
+}
+
+static void
+acquire_rules(void *ptr)
+{
+    rules_t *rules;
+    CAST_OBJ_NOTNULL(rules, ptr, RULES_MAGIC);
+    AN(__atomic_fetch_add(&rules->refs, 1, __ATOMIC_RELAXED));
+}
+
+static void
+release_rules(void *ptr)
+{
+    rules_t *rules;
+    CAST_OBJ_NOTNULL(rules, ptr, RULES_MAGIC);
+    if (__atomic_sub_fetch(&rules->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_rules(rules);
+    }
 }
 
 /******************************************************************************
  * BASICS.
  *****************************************************************************/
 
-rules_t *
-rules_parse(VRT_CTX, struct vmod_cfg_rules *rules, char *contents)
+struct rules_stream_ctx {
+    rules_t *rules;
+    unsigned row;
+    unsigned error;
+};
+
+static void *
+rules_stream_start(VRT_CTX, void *ptr)
 {
-    rules_t *result = malloc(sizeof(rules_t));
+    struct rules_stream_ctx *result = malloc(sizeof(struct rules_stream_ctx));
     AN(result);
-    VTAILQ_INIT(result);
-    unsigned error = 0;
+    result->rules = new_rules();
+    result->row = 0;
+    result->error = 0;
+    return result;
+}
 
-    char *line, *line_end, *regexp, *regexp_end, *value, *value_end;
-    char line_end_char, regexp_end_char, value_end_char;
-    unsigned row = 1;
-    line = contents;
-    while (*line != '\0') {
-        // Isolate line.
-        line_end = strchr(line, '\n');
-        if (line_end != NULL) {
-            *line_end = '\0';
-            line_end_char = '\n';
-        } else {
-            line_end = line + strlen(line);
-            line_end_char = '\0';
-        }
+static unsigned
+rules_stream_line(VRT_CTX, void *ptr, void *state, char *line)
+{
+    struct vmod_cfg_rules *rules;
+    CAST_OBJ_NOTNULL(rules, ptr, VMOD_CFG_RULES_MAGIC);
+    struct rules_stream_ctx *stream = (struct rules_stream_ctx *) state;
+    unsigned error = 0;
 
-        // Skip empty lines.
-        regexp = line;
-        for (; (*regexp != '\0') && isspace(*regexp); regexp++);
-        if (*regexp == '\0') {
-            goto skip;
-        }
+    char *line_end, *regexp, *regexp_end, *value, *value_end;
+    unsigned row = ++stream->row;
+    line_end = line + strlen(line);
 
-        // Extract regexp.
-        value = strstr(regexp, "->");
-        if (value == NULL) {
-            error = 1;
-            goto skip;
-        }
-        if (value == regexp) {
-            error = 2;
-            goto skip;
-        }
-        regexp_end = value;
-        for (; (regexp_end > regexp) && isspace(*(regexp_end - 1)); regexp_end--);
-
-        // Extract value.
-        value += 2;
-        for (; (*value != '\0') && isspace(*value); value++);
-        value_end = line_end;
-        for (; (value_end > value) && isspace(*(value_end - 1)); value_end--);
-
-        // Isolate regexp & value.
-        regexp_end_char = *regexp_end;
-        *regexp_end = '\0';
-        value_end_char = *value_end;
-        *value_end = '\0';
-
-        // Compile & create rule.
-        int errorcode, erroroffset;
-        vre_t *vre = VRE_compile(regexp, 0, &errorcode, &erroroffset, 1);
-        if (vre == NULL) {
-            struct vsb vsb;
-            char errbuf[VRE_ERROR_LEN];
-            AN(VSB_init(&vsb, errbuf, sizeof errbuf));
-            AZ(VRE_error(&vsb, errorcode));
-            AZ(VSB_finish(&vsb));
-            VSB_fini(&vsb);
-            LOG(ctx, LOG_ERR,
-                "Got error while compiling regexp at line %d (%s): %s",
-                row, regexp, errbuf);
-            error = 3;
-        } else {
-            rule_t *rule = new_rule(vre, value);
-            VTAILQ_INSERT_TAIL(result, rule, list);
-        }
-
-        // Restore regexp & value.
-        *regexp_end = regexp_end_char;
-        *value_end = value_end_char;
+    // Skip empty lines.
+    regexp = line;
+    for (; (*regexp != '\0') && isspace(*regexp); regexp++);
+    if (*regexp == '\0') {
+        return 1;
+    }
 
-skip:
-        // Restore line.
-        *line_end = line_end_char;
+    // Extract regexp.
+    value = strstr(regexp, "->");
+    if (value == NULL) {
+        error = 1;
+        goto done;
+    }
+    if (value == regexp) {
+        error = 2;
+        goto done;
+    }
+    regexp_end = value;
+    for (; (regexp_end > regexp) && isspace(*(regexp_end - 1)); regexp_end--);
+
+    // Extract value.
+    value += 2;
+    for (; (*value != '\0') && isspace(*value); value++);
+    value_end = line_end;
+    for (; (value_end > value) && isspace(*(value_end - 1)); value_end--);
+
+    // Isolate regexp & value.
+    *regexp_end = '\0';
+    *value_end = '\0';
+
+    // Compile & create rule.
+    int errorcode, erroroffset;
+    vre_t *vre = VRE_compile(regexp, 0, &errorcode, &erroroffset, 1);
+    if (vre == NULL) {
+        struct vsb vsb;
+        char errbuf[VRE_ERROR_LEN];
+        AN(VSB_init(&vsb, errbuf, sizeof errbuf));
+        AZ(VRE_error(&vsb, errorcode));
+        AZ(VSB_finish(&vsb));
+        VSB_fini(&vsb);
+        LOG(ctx, LOG_ERR,
+            "Got error while compiling regexp at line %d (%s): %s",
+            row, regexp, errbuf);
+        error = 3;
+    } else {
+        rule_t *rule = new_rule(vre, value);
+        VTAILQ_INSERT_TAIL(&stream->rules->list, rule, list);
+    }
 
-        // Jump to next line?
-        if (error) {
-            LOG(ctx, LOG_ERR,
-                "Got error while parsing rules (rules=%s, line=%d, error=%d)",
-                rules->name, row, error);
-            flush_rules(result);
-            free((void *) result);
-            result = NULL;
-            break;
-        } else {
-            line =  (*line_end == '\n') ? (line_end + 1) : line_end;
-            row++;
-        }
+done:
+    if (error) {
+        LOG(ctx, LOG_ERR,
+            "Got error while parsing rules (rules=%s, line=%d, error=%d)",
+            rules->name, row, error);
+        stream->error = error;
     }
 
-    return result;
+    return !error;
 }
 
 static unsigned
-rules_check_callback(VRT_CTX, void *ptr, char *contents, unsigned is_backup)
+rules_stream_finish(
+    VRT_CTX, void *ptr, void *state, unsigned is_backup, unsigned commit)
 {
     unsigned result = 0;
 
     struct vmod_cfg_rules *vmod_cfg_rules;
     CAST_OBJ_NOTNULL(vmod_cfg_rules, ptr, VMOD_CFG_RULES_MAGIC);
+    struct rules_stream_ctx *stream = (struct rules_stream_ctx *) state;
 
-    rules_t *rules = rules_parse(ctx, vmod_cfg_rules, contents);
-    if (rules != NULL) {
+    if (commit) {
         LOG(ctx, LOG_INFO,
             "Remote successfully parsed (rules=%s, location=%s, is_backup=%d)",
             vmod_cfg_rules->name, vmod_cfg_rules->remote->location.raw, is_backup);
 
-        AZ(pthread_rwlock_wrlock(&vmod_cfg_rules->state.rwlock));
-        rules_t *old = vmod_cfg_rules->state.rules;
-        vmod_cfg_rules->state.rules = rules;
-        AZ(pthread_rwlock_unlock(&vmod_cfg_rules->state.rwlock));
-
-        flush_rules(old);
-        free((void *) old);
+        publish_epoch_pointer(
+            (void **) &vmod_cfg_rules->state.rules, stream->rules,
+            release_rules);
 
         result = 1;
     } else {
-        LOG(ctx, LOG_ERR,
-            "Failed to parse remote (rules=%s, location=%s, is_backup=%d)",
-            vmod_cfg_rules->name, vmod_cfg_rules->remote->location.raw, is_backup);
+        if (stream->error) {
+            LOG(ctx, LOG_ERR,
+                "Failed to parse remote (rules=%s, location=%s, is_backup=%d)",
+                vmod_cfg_rules->name, vmod_cfg_rules->remote->location.raw, is_backup);
+        }
+
+        free_rules(stream->rules);
     }
 
+    free((void *) stream);
+
     return result;
 }
 
+static const remote_stream_t rules_stream = {
+    .start = rules_stream_start,
+    .line = rules_stream_line,
+    .finish = rules_stream_finish
+};
+
+static const char *
+rules_match(VRT_CTX, rules_t *rules, const char *value, const char *fallback)
+{
+    CHECK_OBJ_NOTNULL(rules, RULES_MAGIC);
+
+    rule_t *irule;
+    VTAILQ_FOREACH(irule, &rules->list, list) {
+        CHECK_OBJ_NOTNULL(irule, RULE_MAGIC);
+        if (VRT_re_match(ctx, value, irule->vre)) {
+            return irule->value;
+        }
+    }
+
+    return fallback;
+}
+
 static unsigned
 rules_check(VRT_CTX, struct vmod_cfg_rules *rules, unsigned force_load, unsigned force_backup)
 {
-    return check_remote(ctx, rules->remote, force_load, force_backup, &rules_check_callback, rules);
+    return check_remote(ctx, rules->remote, force_load, force_backup);
 }
 
 VCL_VOID
 vmod_rules__init(
     VRT_CTX, struct vmod_cfg_rules **rules, const char *vcl_name,
     VCL_STRING location, VCL_STRING backup, VCL_BOOL automated_backups, VCL_INT period,
-    VCL_BOOL ignore_load_failures, VCL_INT curl_connection_timeout,
+    VCL_BOOL ignore_load_failures, VCL_BOOL warm_start, VCL_BOOL keep_contents,
+    VCL_INT curl_connection_timeout,
     VCL_INT curl_transfer_timeout, VCL_BOOL curl_ssl_verify_peer,
     VCL_BOOL curl_ssl_verify_host, VCL_STRING curl_ssl_cafile,
-    VCL_STRING curl_ssl_capath, VCL_STRING curl_proxy)
+    VCL_STRING curl_ssl_capath, VCL_STRING curl_proxy, VCL_BOOL curl_http2,
+    VCL_BOOL curl_compression, VCL_INT curl_max_body_size,
+    VCL_INT curl_watch_timeout, VCL_INT curl_hedge_delay)
 {
     CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
     AN(rules);
@@ -242,26 +306,33 @@ vmod_rules__init(
     struct vmod_cfg_rules *instance = NULL;
 
     if ((location != NULL) && (strlen(location) > 0) &&
+        is_valid_location(ctx, location) &&
         (period >= 0) &&
         (curl_connection_timeout >= 0) &&
-        (curl_transfer_timeout >= 0)) {
+        (curl_transfer_timeout >= 0) &&
+        (curl_max_body_size >= 0) &&
+        (curl_watch_timeout >= 0) &&
+        (curl_hedge_delay >= 0)) {
         ALLOC_OBJ(instance, VMOD_CFG_RULES_MAGIC);
         AN(instance);
 
         instance->name = strdup(vcl_name);
         AN(instance->name);
         instance->remote = new_remote(
-            location, backup, automated_backups,
-            period, curl_connection_timeout, curl_transfer_timeout,
+            ctx, location, backup, automated_backups,
+            period, keep_contents, curl_connection_timeout, curl_transfer_timeout,
             curl_ssl_verify_peer, curl_ssl_verify_host, curl_ssl_cafile,
-            curl_ssl_capath, curl_proxy);
-        AZ(pthread_rwlock_init(&instance->state.rwlock, NULL));
-        instance->state.rules = malloc(sizeof(rules_t));
-        AN(instance->state.rules);
-        VTAILQ_INIT(instance->state.rules);
-
-        if (!rules_check(ctx, instance, 1, 0) && !ignore_load_failures) {
-            vmod_rules__fini(&instance);
+            curl_ssl_capath, curl_proxy, curl_http2, curl_compression,
+            curl_max_body_size, curl_watch_timeout, curl_hedge_delay, NULL,
+            &rules_stream, NULL, NULL, instance);
+        instance->state.rules = new_rules();
+
+        if (!(warm_start && warm_start_remote(ctx, instance->remote))) {
+            if (ignore_load_failures) {
+                load_remote(ctx, instance->remote);
+            } else if (!rules_check(ctx, instance, 1, 0)) {
+                vmod_rules__fini(&instance);
+            }
         }
     }
 
@@ -281,13 +352,11 @@ vmod_rules__fini(struct vmod_cfg_rules **rules)
     struct vmod_cfg_rules *instance = *rules;
     CHECK_OBJ_NOTNULL(instance, VMOD_CFG_RULES_MAGIC);
 
-    free((void *) instance->name);
-    instance->name = NULL;
     free_remote(instance->remote);
     instance->remote = NULL;
-    AZ(pthread_rwlock_destroy(&instance->state.rwlock));
-    flush_rules(instance->state.rules);
-    free((void *) instance->state.rules);
+    free((void *) instance->name);
+    instance->name = NULL;
+    release_rules(instance->state.rules);
     instance->state.rules = NULL;
 
     FREE_OBJ(instance);
@@ -295,10 +364,31 @@ vmod_rules__fini(struct vmod_cfg_rules **rules)
     *rules = NULL;
 }
 
+// See pin_epoch_pointer().
+static rules_t *
+rules_pin(VRT_CTX, struct vmod_cfg_rules *rules, unsigned refresh)
+{
+    return pin_epoch_pointer(
+        ctx, rules, (void **) &rules->state.rules,
+        acquire_rules, release_rules, refresh);
+}
+
+// Tasks explicitly reloading or updating the rules see the new rules in
+// subsequent reads.
 VCL_BOOL
 vmod_rules_reload(VRT_CTX, struct vmod_cfg_rules *rules, VCL_BOOL force_backup)
 {
-    return rules_check(ctx, rules, 1, force_backup);
+    unsigned result = rules_check(ctx, rules, 1, force_backup);
+    rules_pin(ctx, rules, 1);
+    return result;
+}
+
+VCL_BOOL
+vmod_rules_update(VRT_CTX, struct vmod_cfg_rules *rules, VCL_BOOL force_backup)
+{
+    unsigned result = update_remote(ctx, rules->remote, force_backup);
+    rules_pin(ctx, rules, 1);
+    return result;
 }
 
 VCL_VOID
@@ -312,27 +402,45 @@ VCL_STRING
 vmod_rules_get(VRT_CTX, struct vmod_cfg_rules *rules, VCL_STRING value, VCL_STRING fallback)
 {
     AN(ctx->ws);
-    const char *result = fallback;
 
     rules_check(ctx, rules, 0, 0);
 
-    AZ(pthread_rwlock_rdlock(&rules->state.rwlock));
-    rule_t *irule;
-    VTAILQ_FOREACH(irule, rules->state.rules, list) {
-        CHECK_OBJ_NOTNULL(irule, RULE_MAGIC);
-        if (VRT_re_match(ctx, value, irule->vre)) {
-            result = irule->value;
-            break;
-        }
+    // No need to copy values if the rules are pinned until the end of the
+    // task.
+    rules_t *irules = rules_pin(ctx, rules, 0);
+    if (irules != NULL) {
+        return rules_match(ctx, irules, value, fallback);
     }
-    AZ(pthread_rwlock_unlock(&rules->state.rwlock));
 
+    epoch_reader_t *reader = enter_epoch();
+    irules = get_epoch_pointer((void **) &rules->state.rules);
+    const char *result = rules_match(ctx, irules, value, fallback);
+
+    // Values must be copied before leaving the epoch.
+    unsigned failed = 0;
     if (result != NULL) {
         result = WS_Copy(ctx->ws, result, -1);
-        if (result == NULL) {
-            FAIL_WS(ctx, NULL);
-        }
+        failed = result == NULL;
+    }
+    leave_epoch(reader);
+
+    if (failed) {
+        FAIL_WS(ctx, NULL);
     }
 
     return result;
 }
+
+VCL_INT
+vmod_rules_counter(VRT_CTX, struct vmod_cfg_rules *rules, VCL_STRING name)
+{
+    uint64_t value;
+    if (get_remote_counter(rules->remote, name, &value)) {
+        return value;
+    } else {
+        LOG(ctx, LOG_ERR,
+            "Failed to fetch counter (rules=%s, name=%s)",
+            rules->name, name);
+        return 0;
+    }
+}
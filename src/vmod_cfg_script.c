@@ -18,6 +18,18 @@
  * BASICS.
  *****************************************************************************/
 
+static void
+free_function(void *ptr)
+{
+    function_t *function;
+    CAST_OBJ_NOTNULL(function, ptr, FUNCTION_MAGIC);
+    free((void *) function->code);
+    function->code = NULL;
+    free((void *) function->name);
+    function->name = NULL;
+    FREE_OBJ(function);
+}
+
 static unsigned
 script_check_callback(VRT_CTX, void *ptr, char *contents, unsigned is_backup)
 {
@@ -32,17 +44,14 @@ script_check_callback(VRT_CTX, void *ptr, char *contents, unsigned is_backup)
             "Remote successfully compiled (script=%s, location=%s, is_backup=%d, function=%s, code=%.80s...)",
             script->name, script->remote->location.raw, is_backup, name, contents);
 
-        Lck_Lock(&script->state.mutex);
-        if (script->state.function.code != NULL) {
-            free((void *) script->state.function.code);
-        }
-        script->state.function.code = strdup(contents);
-        AN(script->state.function.code);
-        if (script->state.function.name != NULL) {
-            free((void *) script->state.function.name);
-        }
-        script->state.function.name = name;
-        Lck_Unlock(&script->state.mutex);
+        function_t *function;
+        ALLOC_OBJ(function, FUNCTION_MAGIC);
+        AN(function);
+        function->code = strdup(contents);
+        AN(function->code);
+        function->name = name;
+        publish_epoch_pointer(
+            (void **) &script->state.function, function, free_function);
 
         result = 1;
     } else {
@@ -60,7 +69,7 @@ static unsigned
 script_check(VRT_CTX, struct vmod_cfg_script *script, unsigned force_load, unsigned force_backup)
 {
     if (script->remote != NULL) {
-        return check_remote(ctx, script->remote, force_load, force_backup, &script_check_callback, script);
+        return check_remote(ctx, script->remote, force_load, force_backup);
     } else {
         return 1;
     }
@@ -70,14 +79,17 @@ VCL_VOID
 vmod_script__init(
     VRT_CTX, struct vmod_cfg_script **script, const char *vcl_name,
     VCL_STRING location, VCL_STRING backup, VCL_BOOL automated_backups, VCL_INT period,
-    VCL_BOOL ignore_load_failures, VCL_ENUM type, VCL_INT max_engines, VCL_INT max_cycles,
+    VCL_BOOL ignore_load_failures, VCL_BOOL warm_start, VCL_BOOL keep_contents,
+    VCL_ENUM type, VCL_INT max_engines, VCL_INT max_cycles,
     VCL_INT min_gc_cycles, VCL_BOOL enable_sandboxing, VCL_INT lua_gc_step_size,
     VCL_BOOL lua_remove_loadfile_function, VCL_BOOL lua_remove_dotfile_function,
     VCL_BOOL lua_load_package_lib, VCL_BOOL lua_load_io_lib, VCL_BOOL lua_load_os_lib,
     VCL_INT curl_connection_timeout, VCL_INT curl_transfer_timeout,
     VCL_BOOL curl_ssl_verify_peer, VCL_BOOL curl_ssl_verify_host,
     VCL_STRING curl_ssl_cafile, VCL_STRING curl_ssl_capath,
-    VCL_STRING curl_proxy)
+    VCL_STRING curl_proxy, VCL_BOOL curl_http2, VCL_BOOL curl_compression,
+    VCL_INT curl_max_body_size, VCL_INT curl_watch_timeout,
+    VCL_INT curl_hedge_delay)
 {
     CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
     AN(script);
@@ -85,13 +97,17 @@ vmod_script__init(
 
     struct vmod_cfg_script *instance = NULL;
 
-    if ((period >= 0) &&
+    if (((location == NULL) || is_valid_location(ctx, location)) &&
+        (period >= 0) &&
         (max_engines > 0) &&
         (max_cycles >= 0) &&
         (min_gc_cycles > 0) &&
         (lua_gc_step_size > 0) &&
         (curl_connection_timeout >= 0) &&
-        (curl_transfer_timeout >= 0)) {
+        (curl_transfer_timeout >= 0) &&
+        (curl_max_body_size >= 0) &&
+        (curl_watch_timeout >= 0) &&
+        (curl_hedge_delay >= 0)) {
         ALLOC_OBJ(instance, VMOD_CFG_SCRIPT_MAGIC);
         AN(instance);
 
@@ -99,10 +115,12 @@ vmod_script__init(
         AN(instance->name);
         if ((location != NULL) && (strlen(location) > 0)) {
             instance->remote = new_remote(
-                location, backup, automated_backups,
-                period, curl_connection_timeout, curl_transfer_timeout,
+                ctx, location, backup, automated_backups,
+                period, keep_contents, curl_connection_timeout, curl_transfer_timeout,
                 curl_ssl_verify_peer, curl_ssl_verify_host, curl_ssl_cafile,
-                curl_ssl_capath, curl_proxy);
+                curl_ssl_capath, curl_proxy, curl_http2, curl_compression,
+                curl_max_body_size, curl_watch_timeout, curl_hedge_delay,
+                &script_check_callback, NULL, NULL, NULL, instance);
         } else {
             instance->remote = NULL;
         }
@@ -132,8 +150,7 @@ vmod_script__init(
             WRONG("Illegal type value.");
         }
         Lck_New(&instance->state.mutex, vmod_state.locks.script);
-        instance->state.function.code = NULL;
-        instance->state.function.name = NULL;
+        instance->state.function = NULL;
         AZ(pthread_cond_init(&instance->state.engines.cond, NULL));
         instance->state.engines.n = 0;
         VTAILQ_INIT(&instance->state.engines.free);
@@ -146,8 +163,13 @@ vmod_script__init(
         VRBT_INIT(&instance->state.variables.list);
         memset(&instance->state.stats, 0, sizeof(instance->state.stats));
 
-        if (!script_check(ctx, instance, 1, 0) && !ignore_load_failures) {
-            vmod_script__fini(&instance);
+        if ((instance->remote != NULL) &&
+            !(warm_start && warm_start_remote(ctx, instance->remote))) {
+            if (ignore_load_failures) {
+                load_remote(ctx, instance->remote);
+            } else if (!script_check(ctx, instance, 1, 0)) {
+                vmod_script__fini(&instance);
+            }
         }
     }
 
@@ -167,12 +189,12 @@ vmod_script__fini(struct vmod_cfg_script **script)
     struct vmod_cfg_script *instance = *script;
     CHECK_OBJ_NOTNULL(instance, VMOD_CFG_SCRIPT_MAGIC);
 
-    free((void *) instance->name);
-    instance->name = NULL;
     if (instance->remote != NULL) {
         free_remote(instance->remote);
         instance->remote = NULL;
     }
+    free((void *) instance->name);
+    instance->name = NULL;
     instance->max_engines = 0;
     instance->max_cycles = 0;
     instance->min_gc_cycles = 0;
@@ -191,13 +213,9 @@ vmod_script__fini(struct vmod_cfg_script **script)
     instance->api.get_engine_stack_size = NULL;
     instance->api.execute = NULL;
     Lck_Delete(&instance->state.mutex);
-    if (instance->state.function.code != NULL) {
-        free((void *) instance->state.function.code);
-        instance->state.function.code = NULL;
-    }
-    if (instance->state.function.name != NULL) {
-        free((void *) instance->state.function.name);
-        instance->state.function.name = NULL;
+    if (instance->state.function != NULL) {
+        free_function(instance->state.function);
+        instance->state.function = NULL;
     }
     AZ(pthread_cond_destroy(&instance->state.engines.cond));
     instance->state.engines.n = 0;
@@ -227,6 +245,19 @@ vmod_script_reload(VRT_CTX, struct vmod_cfg_script *script, VCL_BOOL force_backu
     return script_check(ctx, script, 1, force_backup);
 }
 
+VCL_BOOL
+vmod_script_update(VRT_CTX, struct vmod_cfg_script *script, VCL_BOOL force_backup)
+{
+    if (script->remote != NULL) {
+        return update_remote(ctx, script->remote, force_backup);
+    } else {
+        LOG(ctx, LOG_ERR,
+            "Updates require a location (script=%s)",
+            script->name);
+        return 0;
+    }
+}
+
 VCL_VOID
 vmod_script_inspect(
     VRT_CTX, struct vmod_cfg_script *script, struct vmod_priv *task_priv)
@@ -242,7 +273,20 @@ vmod_script_inspect(
         }
     } else if (script->remote != NULL) {
         script_check(ctx, script, 0, 0);
-        inspect_remote(ctx, script->remote);
+        if (!inspect_remote(ctx, script->remote) &&
+            ((ctx->method == VCL_MET_SYNTH) ||
+             (ctx->method == VCL_MET_BACKEND_ERROR))) {
+            // Raw contents are not available, but the compiled code is.
+            struct vsb *vsb = NULL;
+            CAST_OBJ_NOTNULL(vsb, ctx->specific, VSB_MAGIC);
+            epoch_reader_t *reader = enter_epoch();
+            function_t *function = get_epoch_pointer(
+                (void **) &script->state.function);
+            if (function != NULL) {
+                AZ(VSB_cat(vsb, function->code));
+            }
+            leave_epoch(reader);
+        }
     }
 }
 
@@ -299,15 +343,16 @@ vmod_script_execute(
         // in the workspace) to be executed.
         if (state->execution.code == NULL) {
             unsigned stop = 0;
-            Lck_Lock(&script->state.mutex);
-            if ((script->state.function.code != NULL) &&
-                (script->state.function.name != NULL)) {
-                code = WS_Copy(ctx->ws, script->state.function.code, -1);
-                name = WS_Copy(ctx->ws, script->state.function.name, -1);
+            epoch_reader_t *reader = enter_epoch();
+            function_t *function = get_epoch_pointer(
+                (void **) &script->state.function);
+            if ((function != NULL) && (function->name != NULL)) {
+                code = WS_Copy(ctx->ws, function->code, -1);
+                name = WS_Copy(ctx->ws, function->name, -1);
             } else {
                 stop = 1;
             }
-            Lck_Unlock(&script->state.mutex);
+            leave_epoch(reader);
             if (stop) {
                 state->execution.result.values[0].type = RESULT_VALUE_TYPE_ERROR;
                 LOG(ctx, LOG_ERR,
@@ -641,6 +686,7 @@ vmod_script_stats(VRT_CTX, struct vmod_cfg_script *script)
 VCL_INT
 vmod_script_counter(VRT_CTX, struct vmod_cfg_script *script, VCL_STRING name)
 {
+    uint64_t value;
     if (strcmp(name, "engines.current") == 0) {
         return script->state.engines.n;
     } else if (strcmp(name, "engines.total") == 0) {
@@ -663,6 +709,9 @@ vmod_script_counter(VRT_CTX, struct vmod_cfg_script *script, VCL_STRING name)
         return script->state.stats.executions.failed;
     } else if (strcmp(name, "executions.gc") == 0) {
         return script->state.stats.executions.gc;
+    } else if ((script->remote != NULL) &&
+               get_remote_counter(script->remote, name, &value)) {
+        return value;
     } else {
         LOG(ctx, LOG_ERR,
             "Failed to fetch counter (script=%s, name=%s)",